@@ -0,0 +1,19 @@
+// Configuration for benchmark builds. Every service URL is overridden from
+// the environment by bench.py, so none of these values leave the machine.
+#pragma once
+#include <string>
+
+const std::string SHEETS_CSV_URL = "http://127.0.0.1:1/csv";
+const int IMAGE_COLUMN_INDEX = 0;
+const int FILENAME_COLUMN_INDEX = 2;
+
+const std::string DROPBOX_TEAM_MEMBER_ID = "dbmid:bench";
+const std::string DROPBOX_NAMESPACE_ID = "1";
+const std::string DROPBOX_REFRESH_TOKEN = "bench";
+const std::string DROPBOX_APP_KEY = "bench";
+const std::string DROPBOX_APP_SECRET = "bench";
+
+const std::string GOOGLE_CLIENT_ID = "bench";
+const std::string GOOGLE_CLIENT_SECRET = "bench";
+const std::string GOOGLE_REFRESH_TOKEN = "bench";
+const std::string GOOGLE_SHEET_ID = "bench";
@@ -0,0 +1,455 @@
+#!/usr/bin/env python3
+"""End-to-end throughput benchmark for the uploader.
+
+Builds main.cpp against bench/Configuration.h, starts an in-process HTTP
+stand-in for every service the uploader talks to (CSV export, image host,
+both OAuth endpoints, Dropbox files/sharing/team calls, and the Sheets
+grid metadata, values:batchGet and values:batchUpdate calls) and runs the uploader on synthetic sheets, pointing it
+at the stand-in through the UPLOADER_*_URL environment variables.
+
+For each sheet size it reports rows/sec, p50/p99 per-row latency (first
+image request to the Sheets write that carries the row's link) and the
+uploader's peak RSS.
+
+    bench/bench.py                          # 100, 1k, 10k and 100k rows
+    bench/bench.py --rows 1000 --latency-ms 80 --throttle-rate 0.05
+    bench/bench.py --rows 10000 --uploader-args="--stream --sheet-rate=10"
+    bench/bench.py --rows 10000 --uploader-args="--read-sheet"
+    bench/bench.py --csv-rows 1000000       # CSV indexing microbenchmark only
+
+Each run starts in an empty directory, so there is no upload cache, run
+journal or token cache from an earlier run. Latency, bandwidth, error and
+429 injection apply to image downloads, uploads, link calls and Sheets
+writes; token, team and sweep calls only get the latency. --commit-ms
+models Dropbox's per-namespace write lock: every commit (files/upload,
+upload_session/finish, each finish_batch_v2 call) holds it that long, one
+at a time.
+"""
+
+import argparse
+import asyncio
+import hashlib
+import json
+import os
+import random
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.parse
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+REPO_DIR = os.path.dirname(BENCH_DIR)
+
+
+# --- Stand-in server ---
+
+class StandIn:
+    def __init__(self, options, rows):
+        self.options = options
+        self.rows = rows
+        self.random = random.Random(1)
+        self.base = ""
+        self.filler = bytes(range(256)) * (options.image_bytes // 256 + 1)
+
+        self.files = {}         # path_lower -> size
+        self.links = {}         # path_lower -> url
+        self.sessions = {}      # session id -> bytes received
+        self.started = {}       # sheet row -> first image request time
+        self.written = {}       # sheet row -> Sheets write time
+        self.requests = 0
+        self.injected_errors = 0
+        self.injected_throttles = 0
+        self.write_lock = None  # created on the server's loop
+
+    # Rows are numbered as sheet rows: the header is row 1.
+    def csv(self):
+        lines = ["image,link,name"]
+        for row in range(2, self.rows + 2):
+            lines.append("%s/img/%d,,bench%d.png" % (self.base, row, row))
+        return ("\n".join(lines) + "\n").encode()
+
+    # The same sheet for --read-sheet. Like a real one, its grid runs on
+    # past the last row with a value.
+    def grid_rows(self):
+        return self.rows + 1 + 100
+
+    def cell(self, row, column):
+        if row == 1:
+            return ["image", "link", "name"][column - 1] if column <= 3 else ""
+        if row > self.rows + 1:
+            return ""
+        return {1: "%s/img/%d" % (self.base, row), 3: "bench%d.png" % row}.get(column, "")
+
+    # values:batchGet with majorDimension=COLUMNS: one single-column R1C1
+    # range per column, trailing empty cells left out as Sheets does.
+    def batch_get(self, query):
+        value_ranges = []
+        for cells in urllib.parse.parse_qs(query)["ranges"]:
+            tab, _, a1 = cells.rpartition("!")
+            first, column, last, _ = map(int, re.fullmatch(r"R(\d+)C(\d+):R(\d+)C(\d+)", a1).groups())
+            if last > self.grid_rows():
+                return 400, {}, {"error": {"code": 400, "message": "Range exceeds grid limits"}}
+            values = [self.cell(row, column) for row in range(first, last + 1)]
+            while values and values[-1] == "":
+                values.pop()
+            value_range = {"range": cells, "majorDimension": "COLUMNS"}
+            if values:
+                value_range["values"] = [values]
+            value_ranges.append(value_range)
+        return 200, {}, {"spreadsheetId": "bench", "valueRanges": value_ranges}
+
+    def image(self, row):
+        # A PNG signature gets it past the uploader's content sniffing
+        prefix = b"\x89PNG\r\n\x1a\n%d:" % row
+        return prefix + self.filler[:max(0, self.options.image_bytes - len(prefix))]
+
+    async def handle(self, reader, writer):
+        try:
+            while True:
+                request = await self.read_request(reader, writer)
+                if request is None:
+                    break
+                method, path, headers, body = request
+                self.requests += 1
+                status, extra, payload = await self.route(method, path, headers, body)
+                self.write_response(writer, method, status, extra, payload)
+                await writer.drain()
+        except (ConnectionError, asyncio.IncompleteReadError):
+            pass
+        finally:
+            writer.close()
+
+    async def read_request(self, reader, writer):
+        line = await reader.readline()
+        if not line:
+            return None
+        method, path, _ = line.decode("latin1").split(" ", 2)
+
+        headers = {}
+        while True:
+            line = await reader.readline()
+            if line in (b"\r\n", b"\n", b""):
+                break
+            name, _, value = line.decode("latin1").partition(":")
+            headers[name.strip().lower()] = value.strip()
+
+        if headers.get("expect", "").lower() == "100-continue":
+            writer.write(b"HTTP/1.1 100 Continue\r\n\r\n")
+            await writer.drain()
+
+        body = b""
+        if headers.get("transfer-encoding", "").lower() == "chunked":
+            chunks = []
+            while True:
+                size = int((await reader.readline()).split(b";")[0], 16)
+                if size == 0:
+                    await reader.readline()
+                    break
+                chunks.append(await reader.readexactly(size))
+                await reader.readline()
+            body = b"".join(chunks)
+        elif "content-length" in headers:
+            body = await reader.readexactly(int(headers["content-length"]))
+        return method, path, headers, body
+
+    def write_response(self, writer, method, status, extra, payload):
+        if isinstance(payload, (dict, list)) or payload is None:
+            payload = json.dumps(payload).encode()
+        reason = {200: "OK", 409: "Conflict", 429: "Too Many Requests", 500: "Internal Server Error"}
+        head = ["HTTP/1.1 %d %s" % (status, reason.get(status, "Status")),
+                "Content-Length: %d" % len(payload)]
+        head += ["%s: %s" % item for item in extra.items()]
+        writer.write(("\r\n".join(head) + "\r\n\r\n").encode())
+        if method != "HEAD":
+            writer.write(payload)
+
+    async def delay(self, transferred=0):
+        o = self.options
+        seconds = (o.latency_ms + self.random.uniform(0, o.jitter_ms)) / 1000
+        if o.bandwidth and transferred:
+            seconds += transferred / o.bandwidth
+        if seconds > 0:
+            await asyncio.sleep(seconds)
+
+    # An injected failure for a data-path call, or None to serve it.
+    def inject(self):
+        o = self.options
+        roll = self.random.random()
+        if roll < o.throttle_rate:
+            self.injected_throttles += 1
+            return 429, {"Retry-After": str(o.retry_after)}, {"error_summary": "too_many_requests/"}
+        if roll < o.throttle_rate + o.error_rate:
+            self.injected_errors += 1
+            return 500, {}, b"injected failure"
+        return None
+
+    async def route(self, method, path, headers, body):
+        path, _, query = path.partition("?")
+        arg = json.loads(headers.get("dropbox-api-arg", "null"))
+        request = json.loads(body) if body and headers.get("content-type") == "application/json" else None
+
+        if method == "HEAD":
+            return 200, {}, b""
+        if path == "/csv":
+            await self.delay()
+            return 200, {"Content-Type": "text/csv"}, self.csv()
+
+        match = re.fullmatch(r"/img/(\d+)", path)
+        if match:
+            row = int(match.group(1))
+            self.started.setdefault(row, time.monotonic())
+            await self.delay(self.options.image_bytes)
+            return self.inject() or (200, {"Content-Type": "image/png", "ETag": '"%d"' % row}, self.image(row))
+
+        if path in ("/oauth2/token", "/token"):
+            await self.delay()
+            return 200, {}, {"access_token": "bench", "expires_in": 14400, "token_type": "bearer"}
+        if path == "/2/team/members/list":
+            await self.delay()
+            return 200, {}, {"members": [{"profile": {"team_member_id": "dbmid:bench"}}]}
+        if path in ("/2/files/list_folder", "/2/files/list_folder/continue"):
+            await self.delay()
+            return 200, {}, {"entries": [], "cursor": "end", "has_more": False}
+
+        if path == "/2/files/upload_session/finish_batch_v2":
+            await self.delay(len(body))
+            failure = self.inject()
+            if failure:
+                return failure
+            await self.hold_write_lock()
+            return 200, {}, {"entries": [self.commit_entry(entry) for entry in request["entries"]]}
+
+        if path.startswith("/2/files/upload"):
+            await self.delay(len(body))
+            failure = self.inject()
+            if failure:
+                return failure
+            if path != "/2/files/upload_session/start" and not path.endswith("append_v2"):
+                await self.hold_write_lock()
+            return self.upload(path, arg, body)
+
+        if path == "/2/sharing/create_shared_link_with_settings":
+            await self.delay()
+            return self.inject() or self.create_link(request["path"].lower())
+        if path == "/2/sharing/list_shared_links":
+            await self.delay()
+            target = (request or {}).get("path", "").lower()
+            links = [self.link_metadata(target)] if target in self.links else []
+            return 200, {}, {"links": links, "has_more": False}
+
+        if path.endswith("/values:batchGet"):
+            await self.delay()
+            return self.batch_get(query)
+        if path.startswith("/v4/spreadsheets/") and query.startswith("fields="):
+            await self.delay()
+            return 200, {}, {"sheets": [{"properties": {"title": "Images",
+                                                        "gridProperties": {"rowCount": self.grid_rows()}}}]}
+
+        if path.endswith("/values:batchUpdate"):
+            await self.delay(len(body))
+            failure = self.inject()
+            if failure:
+                return failure
+            now = time.monotonic()
+            for entry in json.loads(body)["data"]:
+                first, _, last = entry["range"].partition("!")[2].partition(":")
+                first_row = int(re.match(r"R(\d+)", first).group(1))
+                last_row = int(re.match(r"R(\d+)", last).group(1)) if last else first_row
+                for row in range(first_row, last_row + 1):
+                    self.written.setdefault(row, now)
+            return 200, {}, {"totalUpdatedCells": len(self.written)}
+
+        return 404, {}, {"error_summary": "not_found/"}
+
+    def upload(self, path, arg, body):
+        if path == "/2/files/upload_session/start":
+            session = "s%d" % len(self.sessions)
+            self.sessions[session] = len(body)
+            return 200, {}, {"session_id": session}
+
+        if path in ("/2/files/upload_session/append_v2", "/2/files/upload_session/finish"):
+            cursor = arg["cursor"]
+            received = self.sessions[cursor["session_id"]]
+            if cursor["offset"] != received:
+                return 409, {}, {"error_summary": "incorrect_offset/",
+                                 "error": {".tag": "incorrect_offset", "correct_offset": received}}
+            self.sessions[cursor["session_id"]] = received + len(body)
+            if path.endswith("append_v2"):
+                return 200, {}, None
+            return self.commit(arg["commit"]["path"], received + len(body))
+
+        return self.commit(arg["path"], len(body))
+
+    async def hold_write_lock(self):
+        if self.options.commit_ms <= 0:
+            return
+        if self.write_lock is None:
+            self.write_lock = asyncio.Lock()
+        async with self.write_lock:
+            await asyncio.sleep(self.options.commit_ms / 1000)
+
+    def commit_entry(self, entry):
+        cursor = entry["cursor"]
+        if self.sessions.get(cursor["session_id"]) != cursor["offset"]:
+            return {".tag": "failure", "failure": {".tag": "lookup_failed"}}
+        return dict(self.commit(entry["commit"]["path"], cursor["offset"])[2], **{".tag": "success"})
+
+    def commit(self, path, size):
+        path_lower = path.lower()
+        self.files[path_lower] = size
+        name = path.rsplit("/", 1)[-1]
+        return 200, {}, {"name": name, "path_lower": path_lower, "path_display": path,
+                         "id": "id:" + path_lower, "size": size}
+
+    def link_metadata(self, path_lower):
+        return {".tag": "file", "url": self.links[path_lower], "path_lower": path_lower}
+
+    def create_link(self, path_lower):
+        if path_lower in self.links:
+            return 409, {}, {"error_summary": "shared_link_already_exists/",
+                             "error": {".tag": "shared_link_already_exists",
+                                       "shared_link_already_exists": {".tag": "metadata",
+                                                                      "metadata": self.link_metadata(path_lower)}}}
+        key = hashlib.sha1(path_lower.encode()).hexdigest()[:12]
+        self.links[path_lower] = "https://www.dropbox.com/scl/fi/%s/%s?dl=0" % (key, path_lower.rsplit("/", 1)[-1])
+        return 200, {}, self.link_metadata(path_lower)
+
+
+# Serves on its own thread until the returned stop() is called.
+def start_stand_in(stand_in):
+    loop = asyncio.new_event_loop()
+    server = loop.run_until_complete(
+        asyncio.start_server(stand_in.handle, "127.0.0.1", 0, backlog=1024))
+    stand_in.base = "http://127.0.0.1:%d" % server.sockets[0].getsockname()[1]
+
+    thread = threading.Thread(target=loop.run_forever, daemon=True)
+    thread.start()
+
+    def stop():
+        loop.call_soon_threadsafe(loop.stop)
+        thread.join()
+        server.close()
+        loop.close()
+    return stop
+
+
+# --- Runs ---
+
+def build(output):
+    source_dir = tempfile.mkdtemp(prefix="uploader-bench-src-")
+    shutil.copy(os.path.join(REPO_DIR, "main.cpp"), source_dir)
+    shutil.copy(os.path.join(BENCH_DIR, "Configuration.h"), source_dir)
+    command = ["g++", "-std=c++20", "-O2", os.path.join(source_dir, "main.cpp"), "-lcurl", "-o", output]
+    print("Building:", " ".join(command), file=sys.stderr)
+    subprocess.run(command, check=True)
+    shutil.rmtree(source_dir)
+
+
+# Builds and runs csv_bench.cpp: the old CSV parse against CsvTable.
+def run_csv_bench(rows):
+    binary = os.path.join(tempfile.mkdtemp(prefix="uploader-bench-bin-"), "csv_bench")
+    command = ["g++", "-std=c++20", "-O2", "-I" + BENCH_DIR, os.path.join(BENCH_DIR, "csv_bench.cpp"),
+               "-lcurl", "-o", binary]
+    print("Building:", " ".join(command), file=sys.stderr)
+    subprocess.run(command, check=True)
+    status = subprocess.run([binary, str(rows)]).returncode
+    shutil.rmtree(os.path.dirname(binary))
+    return status
+
+
+def percentile(values, fraction):
+    if not values:
+        return float("nan")
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(fraction * len(ordered)))]
+
+
+def run(uploader, rows, options):
+    stand_in = StandIn(options, rows)
+    stop = start_stand_in(stand_in)
+    workdir = tempfile.mkdtemp(prefix="uploader-bench-run-")
+
+    env = dict(os.environ)
+    for name in ("UPLOADER_DROPBOX_API_URL", "UPLOADER_DROPBOX_CONTENT_URL",
+                 "UPLOADER_GOOGLE_OAUTH_URL", "UPLOADER_SHEETS_URL"):
+        env[name] = stand_in.base
+    env["UPLOADER_CSV_URL"] = stand_in.base + "/csv"
+
+    command = [uploader, "/Bench"] + options.uploader_args.split()
+    with open(os.path.join(workdir, "stderr.txt"), "wb") as err:
+        started = time.monotonic()
+        process = subprocess.Popen(command, cwd=workdir, env=env, stdout=subprocess.DEVNULL, stderr=err)
+        _, status, usage = os.wait4(process.pid, 0)
+        wall = time.monotonic() - started
+
+    stop()
+
+    latencies = [(stand_in.written[row] - stand_in.started[row]) * 1000
+                 for row in stand_in.written if row in stand_in.started]
+    result = {
+        "rows": rows,
+        "written": len(stand_in.written),
+        "exit": os.waitstatus_to_exitcode(status),
+        "wall_s": round(wall, 3),
+        "rows_per_s": round(len(stand_in.written) / wall, 1) if wall > 0 else 0,
+        "p50_ms": round(percentile(latencies, 0.50), 1),
+        "p99_ms": round(percentile(latencies, 0.99), 1),
+        "peak_rss_mb": round(usage.ru_maxrss / 1024, 1),
+        "requests": stand_in.requests,
+        "injected_errors": stand_in.injected_errors,
+        "injected_429s": stand_in.injected_throttles,
+    }
+
+    if result["exit"] != 0 or result["written"] != rows:
+        result["stderr"] = os.path.join(workdir, "stderr.txt")
+    else:
+        shutil.rmtree(workdir)
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--rows", default="100,1000,10000,100000", help="comma-separated sheet sizes")
+    parser.add_argument("--latency-ms", type=float, default=20, help="added to every response")
+    parser.add_argument("--jitter-ms", type=float, default=10, help="uniform extra latency on top")
+    parser.add_argument("--bandwidth", type=float, default=0, help="bytes/s per transfer, 0 for unlimited")
+    parser.add_argument("--image-bytes", type=int, default=64 * 1024)
+    parser.add_argument("--error-rate", type=float, default=0, help="fraction of data-path calls answered 500")
+    parser.add_argument("--throttle-rate", type=float, default=0, help="fraction of data-path calls answered 429")
+    parser.add_argument("--retry-after", type=int, default=1, help="Retry-After seconds on injected 429s")
+    parser.add_argument("--commit-ms", type=float, default=0, help="namespace write lock held per Dropbox commit")
+    parser.add_argument("--uploader", help="prebuilt uploader; built from main.cpp when omitted")
+    parser.add_argument("--uploader-args", default="", help="extra uploader options, space separated")
+    parser.add_argument("--json", help="also append one JSON line per run to this file")
+    parser.add_argument("--csv-rows", type=int, help="run the CSV indexing microbenchmark on this many rows instead")
+    options = parser.parse_args()
+
+    if options.csv_rows:
+        sys.exit(run_csv_bench(options.csv_rows))
+
+    uploader = options.uploader
+    if not uploader:
+        uploader = os.path.join(tempfile.mkdtemp(prefix="uploader-bench-bin-"), "uploader")
+        build(uploader)
+
+    columns = ["rows", "written", "wall_s", "rows_per_s", "p50_ms", "p99_ms", "peak_rss_mb",
+               "requests", "injected_errors", "injected_429s"]
+    print("  ".join("%12s" % c for c in columns))
+
+    for rows in (int(r) for r in options.rows.split(",")):
+        result = run(uploader, rows, options)
+        print("  ".join("%12s" % result[c] for c in columns), flush=True)
+        if "stderr" in result:
+            print("  run failed or incomplete (exit %d); uploader stderr kept in %s"
+                  % (result["exit"], result["stderr"]), file=sys.stderr)
+        if options.json:
+            with open(options.json, "a") as out:
+                out.write(json.dumps(result) + "\n")
+
+
+if __name__ == "__main__":
+    main()
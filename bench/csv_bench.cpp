@@ -0,0 +1,119 @@
+// CSV indexing microbenchmark. Times the export parse the way main() used
+// to do it (extractColumn for the image and file name columns, then a 2D
+// getline/stringstream parse) against one CsvTable index plus the same two
+// column lookups, on a synthetic export of the given size. main.cpp is
+// included, with its main() renamed, so the CsvTable timed is the one that
+// ships.
+//
+//     bench/bench.py --csv-rows 1000000
+//     g++ -std=c++20 -O2 -Ibench bench/csv_bench.cpp -lcurl -o csv_bench && ./csv_bench 1000000
+
+#define main uploaderMain
+#include "../main.cpp"
+#undef main
+
+// --- Old path, as main() had it ---
+
+vector<string> extractColumn(const string& csv, int columnIndex) {
+    vector<string> column;
+    stringstream ss(csv);
+    string line;
+
+    while (getline(ss, line)) {
+        stringstream lineStream(line);
+        string cell;
+
+        for (int i = 0; i <= columnIndex; i++) {
+            if (!getline(lineStream, cell, ',')) {
+                cell = "";
+                break;
+            }
+        }
+
+        column.push_back(cell);
+    }
+
+    return column;
+}
+
+vector<vector<string>> parseRows(const string& csvRaw) {
+    vector<vector<string>> csvData;
+    string line;
+    stringstream ss(csvRaw);
+    while (getline(ss, line)) {
+        stringstream lineStream(line);
+        string cell;
+        vector<string> row;
+        while (getline(lineStream, cell, ',')) row.push_back(cell);
+        csvData.push_back(row);
+    }
+    return csvData;
+}
+
+// --- Synthetic export ---
+
+// Five columns like a real sheet: image URL, link (a third already set),
+// file name, and two text columns. No quoting, so the old path reads it
+// correctly too and both can be checked against each other.
+string makeExport(size_t rows) {
+    string csv = "image,link,name,caption,notes\n";
+    csv.reserve(rows * 120);
+    for (size_t i = 1; i <= rows; ++i) {
+        string n = to_string(i);
+        csv += "https://images.example.com/catalog/" + n + ".jpg,";
+        if (i % 3 == 0) csv += "https://www.dropbox.com/scl/fi/" + n + "/item" + n + ".jpg?dl=1";
+        csv += ",item" + n + ".jpg,Catalog item " + n + ",row " + n + "\n";
+    }
+    return csv;
+}
+
+// Best wall time of a few runs, in seconds.
+template <typename F>
+double bestOf(int runs, F&& body) {
+    double best = 0;
+    for (int run = 0; run < runs; ++run) {
+        auto started = chrono::steady_clock::now();
+        body();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        if (run == 0 || seconds < best) best = seconds;
+    }
+    return best;
+}
+
+int main(int argc, char* argv[]) {
+    size_t rows = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    int runs = argc > 2 ? atoi(argv[2]) : 3;
+    string csv = makeExport(rows);
+
+    size_t checksum = 0;
+    double oldSeconds = bestOf(runs, [&] {
+        vector<string> imageUrls = extractColumn(csv, IMAGE_COLUMN_INDEX);
+        vector<string> fileNames = extractColumn(csv, FILENAME_COLUMN_INDEX);
+        vector<vector<string>> csvData = parseRows(csv);
+        checksum = imageUrls.size() + fileNames.size() + csvData.size();
+    });
+
+    vector<string> imageUrls = extractColumn(csv, IMAGE_COLUMN_INDEX);
+    vector<string> fileNames = extractColumn(csv, FILENAME_COLUMN_INDEX);
+    size_t mismatches = 0;
+    double newSeconds = bestOf(runs, [&] {
+        CsvTable table(csv);
+        mismatches = 0;
+        for (size_t i = 0; i < table.rowCount(); ++i) {
+            if (table.cell(i, IMAGE_COLUMN_INDEX) != imageUrls[i]) ++mismatches;
+            if (table.cell(i, FILENAME_COLUMN_INDEX) != fileNames[i]) ++mismatches;
+        }
+        checksum += table.rowCount();
+    });
+
+    cout << "rows " << rows << ", " << csv.size() / (1024 * 1024) << " MiB, best of " << runs << "\n";
+    cout << fixed << setprecision(3);
+    cout << "  old extractColumn x2 + 2D parse:       " << oldSeconds << " s\n";
+    cout << "  CsvTable index + both column lookups:  " << newSeconds << " s\n";
+    cout << "  speedup " << setprecision(1) << oldSeconds / newSeconds << "x\n";
+    if (mismatches > 0) {
+        cerr << mismatches << " cells differ between the two paths\n";
+        return 1;
+    }
+    return checksum == 0;
+}
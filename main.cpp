@@ -2,9 +2,30 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
 #include <sstream>
+#include <fstream>
+#include <random>
+#include <thread>
+#include <charconv>
+#include <bit>
 #include <curl/curl.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <iomanip>
 #include "Configuration.h"
 
@@ -31,678 +52,5805 @@ size_t writeToString(void* ptr, size_t size, size_t nmemb, void* userdata) {
     return size * nmemb;
 }
 
-string downloadCSV() {
+string trim(const string& s) {
+    size_t start = s.find_first_not_of(" \t\r\n");
+    size_t end = s.find_last_not_of(" \t\r\n");
+    if (start == string::npos) return "";
+    return s.substr(start, end - start + 1);
+}
 
-    cout << "URL = [" << SHEETS_CSV_URL << "]" << endl;
+// Value of the last "name:" header in a raw header block. Redirects leave
+// one block per hop, and the last one belongs to the final response.
+string headerValue(const string& headers, const string& name) {
+    string value;
+    size_t pos = 0;
 
-    CURL* curl = curl_easy_init();
+    while (pos < headers.size()) {
+        size_t end = headers.find('\n', pos);
+        if (end == string::npos) end = headers.size();
 
-    string csvData;
+        if (end - pos > name.size() && headers[pos + name.size()] == ':') {
+            bool match = true;
+            for (size_t k = 0; k < name.size() && match; ++k)
+                match = tolower((unsigned char)headers[pos + k]) == tolower((unsigned char)name[k]);
+            if (match)
+                value = trim(headers.substr(pos + name.size() + 1, end - pos - name.size() - 1));
+        }
 
-    curl_easy_setopt(curl, CURLOPT_URL, SHEETS_CSV_URL.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeToString);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &csvData);
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(curl, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V4);
+        pos = end + 1;
+    }
 
-    CURLcode res = curl_easy_perform(curl);
-    curl_easy_cleanup(curl);
+    return value;
+}
 
-    if (res != CURLE_OK) {
-        cerr << "Curl error: " << curl_easy_strerror(res) << endl;
-        return "";
+// --- JSON ---
+// Responses are read in place: JsonReader walks the buffer a token at a time
+// and hands out string_views into it, so finding a field copies nothing, and
+// lookups go by structure rather than by searching for "key": anywhere in the
+// text. JsonWriter appends to a caller's buffer and escapes every string, so
+// paths and names with quotes or backslashes cannot break a payload.
+
+class JsonReader {
+public:
+    // ',' and ':' are taken as separators and never returned.
+    enum class Token { End, Error, BeginObject, EndObject, BeginArray, EndArray, String, Number, Literal };
+
+    explicit JsonReader(string_view text) : text(text) {}
+
+    Token next() {
+        while (pos < text.size() && strchr(" \t\r\n,:", text[pos]) && text[pos] != '\0')
+            ++pos;
+        start = pos;
+        if (pos >= text.size()) return Token::End;
+
+        char c = text[pos];
+        if (c == '{') { ++pos; return Token::BeginObject; }
+        if (c == '}') { ++pos; return Token::EndObject; }
+        if (c == '[') { ++pos; return Token::BeginArray; }
+        if (c == ']') { ++pos; return Token::EndArray; }
+
+        if (c == '"') {
+            for (++pos; pos < text.size(); ++pos) {
+                if (text[pos] == '\\') ++pos;
+                else if (text[pos] == '"') {
+                    current = text.substr(start + 1, pos - start - 1);
+                    ++pos;
+                    return Token::String;
+                }
+            }
+            return Token::Error;
+        }
+
+        while (pos < text.size() && !strchr(" \t\r\n,:]}", text[pos]))
+            ++pos;
+        current = text.substr(start, pos - start);
+        if (c == '-' || (c >= '0' && c <= '9')) return Token::Number;
+        if (current == "true" || current == "false" || current == "null") return Token::Literal;
+        return Token::Error;
+    }
+
+    // String contents (still escaped), or a number or literal as written.
+    string_view value() const { return current; }
+
+    // Offset where the last token began; with offset() it spans the raw text.
+    size_t tokenStart() const { return start; }
+    size_t offset() const { return pos; }
+
+    // Reads past the rest of a value whose first token was just returned.
+    bool skip(Token first) {
+        if (first != Token::BeginObject && first != Token::BeginArray)
+            return first != Token::End && first != Token::Error;
+
+        int depth = 1;
+        while (depth > 0) {
+            Token token = next();
+            if (token == Token::End || token == Token::Error) return false;
+            if (token == Token::BeginObject || token == Token::BeginArray) ++depth;
+            else if (token == Token::EndObject || token == Token::EndArray) --depth;
+        }
+        return true;
     }
 
-    return csvData;
+private:
+    string_view text;
+    size_t pos = 0;
+    size_t start = 0;
+    string_view current;
+};
+
+// Raw text of the value under key in a JSON object (a string keeps its
+// quotes). Only the object's own members are searched. Empty when missing.
+string_view jsonMember(string_view object, string_view key) {
+    JsonReader reader(object);
+    if (reader.next() != JsonReader::Token::BeginObject) return {};
+
+    while (reader.next() == JsonReader::Token::String) {
+        bool match = reader.value() == key;
+        JsonReader::Token token = reader.next();
+        size_t start = reader.tokenStart();
+        if (!reader.skip(token)) return {};
+        if (match) return object.substr(start, reader.offset() - start);
+    }
+    return {};
 }
 
-vector<string> extractColumn(const string& csv, int columnIndex) {
-    vector<string> column;
-    stringstream ss(csv);
-    string line;
+// Follows a chain of member names, e.g. {"error", "correct_offset"}.
+string_view jsonMember(string_view object, initializer_list<string_view> path) {
+    for (string_view key : path) {
+        object = jsonMember(object, key);
+        if (object.empty()) break;
+    }
+    return object;
+}
 
-    while (getline(ss, line)) {
-        stringstream lineStream(line);
-        string cell;
+// Elements of a JSON array as raw views, one per call to next().
+class JsonElements {
+public:
+    explicit JsonElements(string_view array) : text(array), reader(array) {
+        ok = reader.next() == JsonReader::Token::BeginArray;
+    }
 
-        for (int i = 0; i <= columnIndex; i++) {
-            if (!getline(lineStream, cell, ',')) {
-                cell = "";
-                break;
-            }
+    bool next(string_view& element) {
+        if (!ok) return false;
+        JsonReader::Token token = reader.next();
+        size_t start = reader.tokenStart();
+        if (token == JsonReader::Token::EndArray || !reader.skip(token)) {
+            ok = false;
+            return false;
+        }
+        element = text.substr(start, reader.offset() - start);
+        return true;
+    }
+
+private:
+    string_view text;
+    JsonReader reader;
+    bool ok = false;
+};
+
+// Members of a JSON object as key (still escaped) and raw value views, one
+// per call to next().
+class JsonMembers {
+public:
+    explicit JsonMembers(string_view object) : text(object), reader(object) {
+        ok = reader.next() == JsonReader::Token::BeginObject;
+    }
+
+    bool next(string_view& key, string_view& value) {
+        if (!ok || reader.next() != JsonReader::Token::String) {
+            ok = false;
+            return false;
+        }
+        key = reader.value();
+        JsonReader::Token token = reader.next();
+        size_t start = reader.tokenStart();
+        if (!reader.skip(token)) {
+            ok = false;
+            return false;
         }
+        value = text.substr(start, reader.offset() - start);
+        return true;
+    }
+
+private:
+    string_view text;
+    JsonReader reader;
+    bool ok = false;
+};
 
-        column.push_back(cell);
+void appendUtf8(string& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out += char(cp);
+    }
+    else if (cp < 0x800) {
+        out += char(0xC0 | (cp >> 6));
+        out += char(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000) {
+        out += char(0xE0 | (cp >> 12));
+        out += char(0x80 | ((cp >> 6) & 0x3F));
+        out += char(0x80 | (cp & 0x3F));
     }
+    else {
+        out += char(0xF0 | (cp >> 18));
+        out += char(0x80 | ((cp >> 12) & 0x3F));
+        out += char(0x80 | ((cp >> 6) & 0x3F));
+        out += char(0x80 | (cp & 0x3F));
+    }
+}
+
+// Decoded contents of a raw JSON string value; empty when raw is not a string.
+string jsonString(string_view raw) {
+    string out;
+    if (raw.size() < 2 || raw.front() != '"' || raw.back() != '"') return out;
+    raw = raw.substr(1, raw.size() - 2);
+    out.reserve(raw.size());
+
+    auto hex4 = [&](size_t at) -> uint32_t {
+        uint32_t cp = 0;
+        if (at + 4 > raw.size()) return 0xFFFD;
+        from_chars(raw.data() + at, raw.data() + at + 4, cp, 16);
+        return cp;
+    };
+
+    for (size_t i = 0; i < raw.size(); ++i) {
+        if (raw[i] != '\\' || i + 1 == raw.size()) {
+            out += raw[i];
+            continue;
+        }
 
-    return column;
+        char c = raw[++i];
+        switch (c) {
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'u': {
+            uint32_t cp = hex4(i + 1);
+            i += 4;
+            // Characters outside the BMP arrive as a surrogate pair
+            if (cp >= 0xD800 && cp < 0xDC00 && i + 2 < raw.size() && raw[i + 1] == '\\' && raw[i + 2] == 'u') {
+                uint32_t low = hex4(i + 3);
+                if (low >= 0xDC00 && low < 0xE000) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    i += 6;
+                }
+            }
+            appendUtf8(out, cp);
+            break;
+        }
+        default: out += c; break;   // \" \\ \/
+        }
+    }
+    return out;
 }
 
-string trim(const string& s) {
-    size_t start = s.find_first_not_of(" \t\r\n");
-    size_t end = s.find_last_not_of(" \t\r\n");
-    if (start == string::npos) return "";
-    return s.substr(start, end - start + 1);
+// Integer value of a raw JSON number; fallback when it is not one.
+long long jsonNumber(string_view raw, long long fallback = 0) {
+    long long n = fallback;
+    if (from_chars(raw.data(), raw.data() + raw.size(), n).ec != errc())
+        return fallback;
+    return n;
 }
 
-bool needsProcessing(const string& cell) {
-    string c = trim(cell);
+// Appends JSON to out. Commas go in by themselves; strings are escaped.
+// asciiOnly escapes everything past 0x7E as \uXXXX, which HTTP headers
+// such as Dropbox-API-Arg require.
+class JsonWriter {
+public:
+    explicit JsonWriter(string& out, bool asciiOnly = false) : out(out), asciiOnly(asciiOnly) {}
+
+    JsonWriter& beginObject() { separate(); out += '{'; comma = false; return *this; }
+    JsonWriter& endObject() { out += '}'; comma = true; return *this; }
+    JsonWriter& beginArray() { separate(); out += '['; comma = false; return *this; }
+    JsonWriter& endArray() { out += ']'; comma = true; return *this; }
+
+    JsonWriter& key(string_view name) {
+        separate();
+        quoted(name);
+        out += ':';
+        comma = false;
+        return *this;
+    }
 
-    if (c.empty())
-        return false;
+    JsonWriter& value(string_view text) { separate(); quoted(text); comma = true; return *this; }
+    JsonWriter& value(const char* text) { return value(string_view(text)); }
 
-    if (c.find("dropbox.com") != string::npos)
-        return false;
+    JsonWriter& number(long long n) {
+        separate();
+        char digits[24];
+        out.append(digits, to_chars(digits, digits + sizeof digits, n).ptr);
+        comma = true;
+        return *this;
+    }
 
-    return c.rfind("http", 0) == 0;
+    JsonWriter& boolean(bool b) { separate(); out += b ? "true" : "false"; comma = true; return *this; }
+
+private:
+    void separate() {
+        if (comma) out += ',';
+    }
+
+    void quoted(string_view text) {
+        out += '"';
+        for (size_t i = 0; i < text.size(); ++i) {
+            unsigned char c = text[i];
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += char(c);
+            }
+            else if (c < 0x20 || (asciiOnly && c >= 0x7F)) {
+                uint32_t cp = c;
+                if (c >= 0x80) cp = decodeUtf8(text, i);
+                escapeCodePoint(cp);
+            }
+            else {
+                out += char(c);
+            }
+        }
+        out += '"';
+    }
+
+    // Code point of the UTF-8 sequence at text[i]; leaves i on its last byte.
+    static uint32_t decodeUtf8(string_view text, size_t& i) {
+        unsigned char lead = text[i];
+        int extra = lead >= 0xF0 ? 3 : lead >= 0xE0 ? 2 : lead >= 0xC0 ? 1 : -1;
+        if (extra < 0 || i + extra >= text.size()) return 0xFFFD;
+
+        uint32_t cp = lead & (0x3F >> extra);
+        for (int k = 1; k <= extra; ++k) {
+            unsigned char next = text[i + k];
+            if ((next & 0xC0) != 0x80) return 0xFFFD;
+            cp = (cp << 6) | (next & 0x3F);
+        }
+        i += extra;
+        return cp;
+    }
+
+    void escapeCodePoint(uint32_t cp) {
+        static const char hex[] = "0123456789abcdef";
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            escapeCodePoint(0xD800 + (cp >> 10));
+            escapeCodePoint(0xDC00 + (cp & 0x3FF));
+            return;
+        }
+        char unit[6] = { '\\', 'u', hex[(cp >> 12) & 0xF], hex[(cp >> 8) & 0xF], hex[(cp >> 4) & 0xF], hex[cp & 0xF] };
+        out.append(unit, 6);
+    }
+
+    string& out;
+    bool asciiOnly;
+    bool comma = false;
+};
+
+// --- Service URLs ---
+// Base URLs of the services the uploader talks to. Each can be pointed
+// elsewhere from the environment, which is how bench/ runs the whole
+// pipeline against a local stand-in:
+//   UPLOADER_CSV_URL, UPLOADER_DROPBOX_API_URL, UPLOADER_DROPBOX_CONTENT_URL,
+//   UPLOADER_GOOGLE_OAUTH_URL, UPLOADER_SHEETS_URL
+
+struct ServiceUrls {
+    string csv = SHEETS_CSV_URL;
+    string dropboxApi = "https://api.dropboxapi.com";
+    string dropboxContent = "https://content.dropboxapi.com";
+    string googleOAuth = "https://oauth2.googleapis.com";
+    string sheets = "https://sheets.googleapis.com";
+};
+
+const ServiceUrls& serviceUrls() {
+    static const ServiceUrls urls = [] {
+        ServiceUrls u;
+        auto fromEnv = [](string& url, const char* name) {
+            const char* value = getenv(name);
+            if (value && *value) url = value;
+        };
+        fromEnv(u.csv, "UPLOADER_CSV_URL");
+        fromEnv(u.dropboxApi, "UPLOADER_DROPBOX_API_URL");
+        fromEnv(u.dropboxContent, "UPLOADER_DROPBOX_CONTENT_URL");
+        fromEnv(u.googleOAuth, "UPLOADER_GOOGLE_OAUTH_URL");
+        fromEnv(u.sheets, "UPLOADER_SHEETS_URL");
+        return u;
+    }();
+    return urls;
 }
 
-size_t writeTextCallback(void* contents, size_t size, size_t nmemb, void* userp)
-{
-    size_t total = size * nmemb;
-    std::string* s = static_cast<std::string*>(userp);
-    s->append(static_cast<char*>(contents), total);
-    return total;
+// --- Connection pool ---
+// Easy handles are kept per host and reused, and every handle joins one share
+// handle for the DNS cache, TLS sessions and the connection cache, so rows
+// reuse keep-alive connections to the Dropbox and Google hosts.
+
+// scheme://host[:port], the unit keep-alive connections are reused by
+string hostKey(const string& url) {
+    size_t start = url.find("://");
+    start = (start == string::npos) ? 0 : start + 3;
+    size_t end = url.find_first_of("/?#", start);
+    return url.substr(0, end);
 }
 
-size_t writeBinaryCallback(void* contents, size_t size, size_t nmemb, void* userp)
-{
-    size_t totalSize = size * nmemb;
-    string* buffer = static_cast<string*>(userp);
-    buffer->append(static_cast<char*>(contents), totalSize);
-    return totalSize;
+// HTTP/2 for the Dropbox and Sheets API hosts (--http2). Concurrent calls
+// to one of them go out as streams on a single connection instead of one
+// connection each; a server that does not offer h2 in ALPN gets HTTP/1.1.
+struct TransportOptions {
+    bool http2 = false;
+    size_t maxStreams = 100;        // per connection, --max-streams
+};
+
+class ConnectionPool {
+public:
+    ConnectionPool() : share(curl_share_init()) {
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+
+    ~ConnectionPool() { shutdown(); }
+
+    CURL* acquire(const string& url) {
+        string host = hostKey(url);
+        vector<CURL*>& idle = idleHandles[host];
+
+        CURL* curl = nullptr;
+        if (!idle.empty()) {
+            curl = idle.back();
+            idle.pop_back();
+        }
+        else {
+            curl = curl_easy_init();
+            if (!curl) return nullptr;
+            if (share) curl_easy_setopt(curl, CURLOPT_SHARE, share);
+        }
+
+        handleHost[curl] = host;
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        if (multiplexed(host)) {
+            // Wait for the host's connection to say whether it multiplexes
+            // rather than opening a second one alongside it
+            curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, long(CURL_HTTP_VERSION_2TLS));
+            curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+        }
+        return curl;
+    }
+
+    // Asks for HTTP/2 on the hosts of these URLs. Plain http:// stays on
+    // HTTP/1.1, since 2TLS only upgrades through ALPN.
+    void multiplex(const vector<string>& urls) {
+        for (const string& url : urls)
+            multiplexHosts.insert(hostKey(url));
+    }
+
+    bool multiplexed(const string& host) const { return multiplexHosts.count(host) > 0; }
+
+    void release(CURL* curl) {
+        auto it = handleHost.find(curl);
+        if (it == handleHost.end()) {
+            curl_easy_cleanup(curl);
+            return;
+        }
+
+        vector<CURL*>& idle = idleHandles[it->second];
+        handleHost.erase(it);
+
+        // Reset drops options but keeps live connections and the share
+        curl_easy_reset(curl);
+        if (idle.size() < maxIdlePerHost)
+            idle.push_back(curl);
+        else
+            curl_easy_cleanup(curl);
+    }
+
+    // Must run before curl_global_cleanup(); handles still checked out are
+    // cleaned up by their owners.
+    void shutdown() {
+        for (auto& entry : idleHandles) {
+            for (CURL* curl : entry.second)
+                curl_easy_cleanup(curl);
+        }
+        idleHandles.clear();
+
+        if (share && handleHost.empty()) {
+            curl_share_cleanup(share);
+            share = nullptr;
+        }
+    }
+
+private:
+    static constexpr size_t maxIdlePerHost = 32;
+
+    CURLSH* share;
+    unordered_map<string, vector<CURL*>> idleHandles;
+    unordered_map<CURL*, string> handleHost;
+    set<string> multiplexHosts;
+};
+
+ConnectionPool& connectionPool() {
+    static ConnectionPool pool;
+    return pool;
 }
 
-void addDropboxBusinessHeaders(
-    struct curl_slist*& headers,
-    const string& accessToken
-) {
-    headers = curl_slist_append(headers,
-        ("Authorization: Bearer " + accessToken).c_str());
+// What TransferLoop may do with a throttled or failed attempt.
+enum class RetryPolicy {
+    Any,            // resend on throttling and on transient failures
+    ThrottleOnly,   // resend only when the server refused it (429 / 503)
+    Never           // body cannot be replayed (streams)
+};
 
-    headers = curl_slist_append(headers,
-        ("Dropbox-API-Select-User: " +
-            string(DROPBOX_TEAM_MEMBER_ID)).c_str());
+// One transfer plus everything libcurl needs to stay alive until it completes
+// (header list, request body, response buffer). The easy handle is borrowed
+// from the connection pool for the request's lifetime.
+
+struct HttpRequest {
+    CURL* curl = nullptr;
+    string url;
+    struct curl_slist* headers = nullptr;
+    string body;
+    string response;
+    string responseHeaders; // raw header lines (ETag, Retry-After, ...)
+    CURLcode result = CURLE_OK;
+    long status = 0;        // HTTP status, set by TransferLoop
+    function<void(HttpRequest&)> onDone;
+
+    RetryPolicy retry = RetryPolicy::Any;
+    int attempts = 0;       // resends so far
+    const char* stage = "other";   // label for TransferStats
+    chrono::steady_clock::time_point queuedAt;
+    chrono::steady_clock::time_point startedAt;
+
+    HttpRequest() = default;
+
+    HttpRequest(const string& url, const char* stage)
+        : curl(connectionPool().acquire(url)), url(url), stage(stage)
+    {
+        if (!curl) return;
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, writeToString);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &responseHeaders);
+    }
+
+    HttpRequest(const HttpRequest&) = delete;
+    HttpRequest& operator=(const HttpRequest&) = delete;
+
+    ~HttpRequest() {
+        if (headers) curl_slist_free_all(headers);
+        if (curl) connectionPool().release(curl);
+    }
+};
+
+// Retry and pacing knobs for TransferLoop. Rates are requests per second,
+// 0 for no cap; Sheets allows 60 write and 60 read requests a minute per user.
+struct RateOptions {
+    unsigned long uploadPerSecond = 0;  // content.dropboxapi.com
+    unsigned long apiPerSecond = 0;     // api.dropboxapi.com
+    unsigned long sheetsPerSecond = 1;  // sheets.googleapis.com
+    size_t maxWindow = 64;              // per-endpoint concurrency ceiling
+    int maxRetries = 4;
+    long baseBackoffMs = 500;
+    long maxBackoffMs = 60000;
+};
+
+// Transport worked and the server did not answer with an error status.
+bool httpOk(const HttpRequest& req) {
+    return req.result == CURLE_OK && req.status < 400;
 }
 
-void addDropboxNamespaceHeader(struct curl_slist*& headers) {
-    // JSON, no escaping, Dropbox requires this exact shape
-    string pathRoot =
-        "{\".tag\":\"namespace_id\",\"namespace_id\":\"" +
-        string(DROPBOX_NAMESPACE_ID) + "\"}";
+// Why a request that is not httpOk() failed, for log lines.
+string httpError(const HttpRequest& req) {
+    if (req.result != CURLE_OK)
+        return curl_easy_strerror(req.result);
+    return "HTTP " + to_string(req.status);
+}
 
-    headers = curl_slist_append(
-        headers,
-        ("Dropbox-API-Path-Root: " + pathRoot).c_str()
-    );
+// The server refused the request for load reasons; sending it later is fine.
+bool throttled(const HttpRequest& req) {
+    return req.result == CURLE_OK &&
+        (req.status == 429 || req.status == 503 ||
+            (req.status == 409 && req.response.find("too_many_write_operations") != string::npos));
 }
 
-bool downloadImage(const string& imageUrl, string& imageData)
-{
-    CURL* curl = curl_easy_init();
-    if (!curl) return false;
+// --- Transfer stats ---
+// Every finished attempt is recorded under its request's stage (csv, image,
+// upload, link_create, sheets, ...): status, bytes, and how long each phase
+// of the transfer took, from libcurl's timers. Phases are deltas, so a slow
+// run shows whether the time went to DNS, TCP, TLS, waiting for the first
+// byte or moving the body. dns/connect/tls are only recorded for attempts
+// that opened a new connection. queue is time spent waiting on TransferLoop
+// pacing before libcurl saw the request.
+
+// Log-linear histogram of microsecond values in the spirit of HdrHistogram:
+// exact below 32, then 16 buckets per power of two (within about 6%).
+class LatencyHistogram {
+public:
+    void record(uint64_t us) {
+        size_t bucket = bucketFor(us);
+        if (bucket >= counts.size()) counts.resize(bucket + 1);
+        ++counts[bucket];
+        ++total;
+        sum += us;
+        largest = max(largest, us);
+    }
 
-    curl_easy_setopt(curl, CURLOPT_URL, imageUrl.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeBinaryCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &imageData);
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+    uint64_t count() const { return total; }
+    uint64_t sumUs() const { return sum; }
+    uint64_t maxUs() const { return largest; }
+
+    // Non-empty buckets as [bucket, count] pairs, enough to rebuild the
+    // histogram from a report.
+    void writeBuckets(JsonWriter& json) const {
+        json.beginArray();
+        for (size_t bucket = 0; bucket < counts.size(); ++bucket) {
+            if (counts[bucket])
+                json.beginArray().number((long long)bucket).number((long long)counts[bucket]).endArray();
+        }
+        json.endArray();
+    }
+
+    // Adds a histogram written by writeBuckets.
+    void merge(string_view buckets, uint64_t sumUs, uint64_t maxUs) {
+        string_view pair;
+        JsonElements pairs(buckets);
+        while (pairs.next(pair)) {
+            JsonElements fields(pair);
+            string_view bucketRaw, countRaw;
+            if (!fields.next(bucketRaw) || !fields.next(countRaw)) continue;
+            long long bucket = jsonNumber(bucketRaw, -1);
+            long long n = jsonNumber(countRaw, 0);
+            if (bucket < 0 || bucket > 64 * 16 || n <= 0) continue;
+            if (size_t(bucket) >= counts.size()) counts.resize(size_t(bucket) + 1);
+            counts[size_t(bucket)] += uint64_t(n);
+            total += uint64_t(n);
+        }
+        sum += sumUs;
+        largest = max(largest, maxUs);
+    }
+
+    // Upper edge of the bucket holding the q-th value, capped at the max seen.
+    uint64_t percentileUs(double q) const {
+        uint64_t rank = uint64_t(q * double(total) + 0.5);
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < counts.size(); ++bucket) {
+            seen += counts[bucket];
+            if (seen >= max<uint64_t>(rank, 1))
+                return min(largest, bucketLimit(bucket));
+        }
+        return largest;
+    }
+
+private:
+    static size_t bucketFor(uint64_t v) {
+        int width = bit_width(v);
+        if (width <= 5) return size_t(v);
+        int shift = width - 5;
+        return size_t(shift) * 16 + size_t(v >> shift);
+    }
+
+    static uint64_t bucketLimit(size_t bucket) {
+        if (bucket < 32) return bucket;
+        int shift = int(bucket / 16) - 1;
+        return ((uint64_t(bucket % 16 + 16) + 1) << shift) - 1;
+    }
+
+    vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t largest = 0;
+};
+
+struct ReportOptions {
+    string jsonPath;            // --report-json
+    string prometheusPath;      // --report-prom
+};
+
+class TransferStats {
+public:
+    enum Phase { Queue, Dns, Connect, Tls, FirstByte, Receive, Total, PhaseCount };
+
+    void record(const HttpRequest& req, bool retrying) {
+        StageStats& stage = stageFor(req.stage);
+        ++stage.attempts;
+        if (retrying) ++stage.retries;
+
+        if (req.result != CURLE_OK) ++stage.transportErrors;
+        else ++stage.statuses[req.status];
+
+        curl_off_t up = 0, down = 0;
+        curl_easy_getinfo(req.curl, CURLINFO_SIZE_UPLOAD_T, &up);
+        curl_easy_getinfo(req.curl, CURLINFO_SIZE_DOWNLOAD_T, &down);
+        stage.bytesUp += uint64_t(up);
+        stage.bytesDown += uint64_t(down);
+
+        // Cumulative from the start of the attempt, in microseconds
+        curl_off_t dns = 0, connect = 0, tls = 0, pre = 0, first = 0, total = 0;
+        curl_easy_getinfo(req.curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+        curl_easy_getinfo(req.curl, CURLINFO_CONNECT_TIME_T, &connect);
+        curl_easy_getinfo(req.curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+        curl_easy_getinfo(req.curl, CURLINFO_PRETRANSFER_TIME_T, &pre);
+        curl_easy_getinfo(req.curl, CURLINFO_STARTTRANSFER_TIME_T, &first);
+        curl_easy_getinfo(req.curl, CURLINFO_TOTAL_TIME_T, &total);
+
+        auto delta = [](curl_off_t to, curl_off_t from) { return uint64_t(max<curl_off_t>(0, to - from)); };
+
+        stage.phases[Queue].record(uint64_t(
+            chrono::duration_cast<chrono::microseconds>(req.startedAt - req.queuedAt).count()));
+        if (connect > 0) {
+            ++stage.newConnections;
+            stage.phases[Dns].record(uint64_t(dns));
+            stage.phases[Connect].record(delta(connect, dns));
+            if (tls > 0) stage.phases[Tls].record(delta(tls, connect));
+        }
+        if (first > 0) {
+            stage.phases[FirstByte].record(delta(first, pre));
+            stage.phases[Receive].record(delta(total, first));
+        }
+        stage.phases[Total].record(uint64_t(total));
+    }
+
+    bool writeJson(const string& path, double wallSeconds) const {
+        string out;
+        JsonWriter json(out);
+        json.beginObject()
+            .key("wall_us").number((long long)(wallSeconds * 1e6))
+            .key("stages").beginObject();
+
+        for (const auto& [name, stage] : stages) {
+            json.key(name).beginObject()
+                .key("attempts").number((long long)stage.attempts)
+                .key("retries").number((long long)stage.retries)
+                .key("new_connections").number((long long)stage.newConnections)
+                .key("transport_errors").number((long long)stage.transportErrors)
+                .key("bytes_up").number((long long)stage.bytesUp)
+                .key("bytes_down").number((long long)stage.bytesDown);
+
+            json.key("status").beginObject();
+            for (const auto& [status, count] : stage.statuses)
+                json.key(to_string(status)).number((long long)count);
+            json.endObject();
+
+            json.key("phases").beginObject();
+            for (int phase = 0; phase < PhaseCount; ++phase) {
+                const LatencyHistogram& h = stage.phases[phase];
+                if (h.count() == 0) continue;
+                json.key(phaseNames[phase]).beginObject()
+                    .key("count").number((long long)h.count())
+                    .key("mean_us").number((long long)(h.sumUs() / h.count()))
+                    .key("p50_us").number((long long)h.percentileUs(0.50))
+                    .key("p90_us").number((long long)h.percentileUs(0.90))
+                    .key("p99_us").number((long long)h.percentileUs(0.99))
+                    .key("max_us").number((long long)h.maxUs())
+                    .key("sum_us").number((long long)h.sumUs())
+                    .key("buckets");
+                h.writeBuckets(json);
+                json.endObject();
+            }
+            json.endObject().endObject();
+        }
+        json.endObject().endObject();
+        out += '\n';
+
+        return writeFile(path, out);
+    }
+
+    bool writePrometheus(const string& path, double wallSeconds) const {
+        ostringstream out;
+        out << "# HELP uploader_run_seconds Wall time of the run.\n"
+            << "# TYPE uploader_run_seconds gauge\n"
+            << "uploader_run_seconds " << wallSeconds << "\n";
+
+        out << "# HELP uploader_phase_seconds Time spent in each phase of a transfer attempt.\n"
+            << "# TYPE uploader_phase_seconds summary\n";
+        for (const auto& [name, stage] : stages) {
+            for (int phase = 0; phase < PhaseCount; ++phase) {
+                const LatencyHistogram& h = stage.phases[phase];
+                if (h.count() == 0) continue;
+                string labels = "stage=\"" + name + "\",phase=\"" + phaseNames[phase] + "\"";
+                for (double q : { 0.5, 0.9, 0.99 })
+                    out << "uploader_phase_seconds{" << labels << ",quantile=\"" << q << "\"} "
+                        << h.percentileUs(q) / 1e6 << "\n";
+                out << "uploader_phase_seconds_sum{" << labels << "} " << h.sumUs() / 1e6 << "\n"
+                    << "uploader_phase_seconds_count{" << labels << "} " << h.count() << "\n";
+            }
+        }
+
+        out << "# HELP uploader_attempts_total Transfer attempts by outcome.\n"
+            << "# TYPE uploader_attempts_total counter\n";
+        for (const auto& [name, stage] : stages) {
+            for (const auto& [status, count] : stage.statuses)
+                out << "uploader_attempts_total{stage=\"" << name << "\",status=\"" << status << "\"} " << count << "\n";
+            if (stage.transportErrors)
+                out << "uploader_attempts_total{stage=\"" << name << "\",status=\"error\"} " << stage.transportErrors << "\n";
+        }
+
+        out << "# HELP uploader_retries_total Attempts that were sent again.\n"
+            << "# TYPE uploader_retries_total counter\n";
+        for (const auto& [name, stage] : stages)
+            out << "uploader_retries_total{stage=\"" << name << "\"} " << stage.retries << "\n";
+
+        out << "# HELP uploader_new_connections_total Attempts that opened a connection.\n"
+            << "# TYPE uploader_new_connections_total counter\n";
+        for (const auto& [name, stage] : stages)
+            out << "uploader_new_connections_total{stage=\"" << name << "\"} " << stage.newConnections << "\n";
+
+        out << "# HELP uploader_bytes_total Body bytes moved.\n"
+            << "# TYPE uploader_bytes_total counter\n";
+        for (const auto& [name, stage] : stages) {
+            out << "uploader_bytes_total{stage=\"" << name << "\",direction=\"up\"} " << stage.bytesUp << "\n"
+                << "uploader_bytes_total{stage=\"" << name << "\",direction=\"down\"} " << stage.bytesDown << "\n";
+        }
+
+        return writeFile(path, out.str());
+    }
+
+    // Adds a report written by writeJson, e.g. by another shard of the run.
+    // wallSeconds becomes the longer of the two runs.
+    bool mergeJson(string_view report, double& wallSeconds) {
+        string_view stagesJson = jsonMember(report, "stages");
+        if (stagesJson.empty())
+            return false;
+        wallSeconds = max(wallSeconds, double(jsonNumber(jsonMember(report, "wall_us"))) / 1e6);
+
+        auto counter = [](string_view object, string_view key) {
+            return uint64_t(max(0LL, jsonNumber(jsonMember(object, key))));
+        };
+
+        string_view name, body;
+        JsonMembers stageList(stagesJson);
+        while (stageList.next(name, body)) {
+            StageStats& stage = stageFor(name);
+            stage.attempts += counter(body, "attempts");
+            stage.retries += counter(body, "retries");
+            stage.newConnections += counter(body, "new_connections");
+            stage.transportErrors += counter(body, "transport_errors");
+            stage.bytesUp += counter(body, "bytes_up");
+            stage.bytesDown += counter(body, "bytes_down");
+
+            string_view status, count;
+            JsonMembers statuses(jsonMember(body, "status"));
+            while (statuses.next(status, count))
+                stage.statuses[strtol(string(status).c_str(), nullptr, 10)] += uint64_t(max(0LL, jsonNumber(count)));
+
+            string_view phaseName, phase;
+            JsonMembers phases(jsonMember(body, "phases"));
+            while (phases.next(phaseName, phase)) {
+                auto known = find(begin(phaseNames), end(phaseNames), phaseName);
+                if (known == end(phaseNames)) continue;
+                stage.phases[known - begin(phaseNames)].merge(
+                    jsonMember(phase, "buckets"), counter(phase, "sum_us"), counter(phase, "max_us"));
+            }
+        }
+        return true;
+    }
+
+private:
+    struct StageStats {
+        uint64_t attempts = 0;
+        uint64_t retries = 0;
+        uint64_t newConnections = 0;
+        uint64_t transportErrors = 0;
+        uint64_t bytesUp = 0;
+        uint64_t bytesDown = 0;
+        map<long, uint64_t> statuses;
+        LatencyHistogram phases[PhaseCount];
+    };
+
+    static constexpr const char* phaseNames[PhaseCount] = {
+        "queue", "dns", "connect", "tls", "first_byte", "receive", "total"
+    };
+
+    StageStats& stageFor(string_view name) {
+        auto found = stages.find(name);
+        if (found != stages.end()) return found->second;
+        return stages.emplace(string(name), StageStats()).first->second;
+    }
 
-    CURLcode res = curl_easy_perform(curl);
-    curl_easy_cleanup(curl);
+    static bool writeFile(const string& path, const string& text) {
+        ofstream file(path, ios::trunc);
+        file << text;
+        return bool(file);
+    }
+
+    map<string, StageStats, less<>> stages;
+};
 
-    return res == CURLE_OK && !imageData.empty();
+TransferStats& transferStats() {
+    static TransferStats stats;
+    return stats;
 }
 
-bool uploadToDropbox(
-    const string& accessToken,
-    const string& fileData,
-    const string& dropboxPath,
-    string& responseOut)
-{
-    //cerr << "[uploadToDropbox] ENTER, path=" << dropboxPath << ", file size=" << fileData.size() << endl;
+// Writes whichever reports were asked for; a failed write is only logged.
+void writeTransferReports(const ReportOptions& options, chrono::steady_clock::time_point runStarted) {
+    double wallSeconds = chrono::duration<double>(chrono::steady_clock::now() - runStarted).count();
+    if (!options.jsonPath.empty() && !transferStats().writeJson(options.jsonPath, wallSeconds))
+        cerr << "Could not write report: " << options.jsonPath << endl;
+    if (!options.prometheusPath.empty() && !transferStats().writePrometheus(options.prometheusPath, wallSeconds))
+        cerr << "Could not write report: " << options.prometheusPath << endl;
+}
 
-    CURL* curl = curl_easy_init();
-    if (!curl) {
-        cerr << "[uploadToDropbox] CURL init failed\n";
-        return false;
+// Combines the --report-json files of the shards of one run into a single
+// report, written to whichever of --report-json and --report-prom are set.
+// Shards run side by side, so the merged wall time is the longest one.
+int mergeReports(const vector<string>& paths, const ReportOptions& options) {
+    if (paths.empty() || (options.jsonPath.empty() && options.prometheusPath.empty())) {
+        cerr << "--merge-reports needs report files and --report-json or --report-prom\n";
+        return 1;
     }
 
-    struct curl_slist* headers = nullptr;
+    double wallSeconds = 0;
+    for (const string& path : paths) {
+        ifstream in(path, ios::binary);
+        string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        if (!transferStats().mergeJson(text, wallSeconds)) {
+            cerr << "Not a transfer report: " << path << endl;
+            return 1;
+        }
+    }
+
+    if (!options.jsonPath.empty() && !transferStats().writeJson(options.jsonPath, wallSeconds)) {
+        cerr << "Could not write report: " << options.jsonPath << endl;
+        return 1;
+    }
+    if (!options.prometheusPath.empty() && !transferStats().writePrometheus(options.prometheusPath, wallSeconds)) {
+        cerr << "Could not write report: " << options.prometheusPath << endl;
+        return 1;
+    }
+    return 0;
+}
 
-    string apiArg =
-        "{\"path\":\"" + dropboxPath +
-        "\",\"mode\":\"add\",\"autorename\":true,\"mute\":false}";
+// Drives many HttpRequests at once on a single CURLM handle, paced per
+// endpoint, and resends throttled or transiently failed attempts.
+class TransferLoop {
+public:
+    explicit TransferLoop(const RateOptions& rates = RateOptions(), const TransportOptions& transport = TransportOptions())
+        : multi(curl_multi_init()), rates(rates), transport(transport), random(random_device()()) {
+        if (transport.http2) {
+            curl_multi_setopt(multi, CURLMOPT_PIPELINING, long(CURLPIPE_MULTIPLEX));
+#if LIBCURL_VERSION_NUM >= 0x074300
+            curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, long(transport.maxStreams));
+#endif
+        }
+    }
 
-    addDropboxBusinessHeaders(headers, accessToken);
-    addDropboxNamespaceHeader(headers);
+    ~TransferLoop() {
+        for (auto& entry : active)
+            curl_multi_remove_handle(multi, entry.first);
+        active.clear();
+        curl_multi_cleanup(multi);
+    }
 
-    headers = curl_slist_append(headers,
-        "Content-Type: application/octet-stream");
+    // Queues the request on its endpoint; it starts once the endpoint's
+    // window and rate allow.
+    void add(unique_ptr<HttpRequest> req) {
+        auto now = chrono::steady_clock::now();
+        Endpoint& endpoint = endpointFor(req->url);
+        req->queuedAt = now;
+        endpoint.waiting.push_back(move(req));
+        ++queued;
+        dispatch(endpoint, now);
+    }
 
-    headers = curl_slist_append(headers,
-        ("Dropbox-API-Arg: " + apiArg).c_str());
+    bool empty() const { return active.empty() && queued == 0 && delayed.empty(); }
+
+    // Asks for a paused transfer to be resumed on the next turn of the loop.
+    // Safe to call from inside libcurl callbacks.
+    void resume(CURL* handle) { toResume.push_back(handle); }
+
+    // add() for use inside libcurl callbacks; the request starts on the next
+    // turn of the loop.
+    void addLater(unique_ptr<HttpRequest> req) { toAdd.push_back(move(req)); }
+
+    // Moves transfers forward, fires onDone for finished ones and waits
+    // (bounded) for socket activity.
+    void runOnce() {
+        auto now = chrono::steady_clock::now();
+        bool started = releaseDelayed(now) | dispatchAll(now);
+
+        int running = 0;
+        curl_multi_perform(multi, &running);
+
+        vector<unique_ptr<HttpRequest>> finished;
+        bool retried = false;
+        int pending = 0;
+        while (CURLMsg* msg = curl_multi_info_read(multi, &pending)) {
+            if (msg->msg != CURLMSG_DONE) continue;
+
+            auto it = active.find(msg->easy_handle);
+            if (it == active.end()) continue;
+
+            curl_multi_remove_handle(multi, msg->easy_handle);
+            unique_ptr<HttpRequest> req = move(it->second);
+            active.erase(it);
+
+            req->result = msg->data.result;
+            curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &req->status);
+
+            Endpoint& endpoint = endpointFor(req->url);
+            --endpoint.inFlight;
+            adjustWindow(endpoint, *req);
+            noteHttpVersion(*req);
+
+            long delayMs = retryDelayMs(*req);
+            transferStats().record(*req, delayMs >= 0);
+            if (delayMs >= 0) {
+                ++req->attempts;
+                req->response.clear();
+                req->responseHeaders.clear();
+                delayed.emplace(chrono::steady_clock::now() + chrono::milliseconds(delayMs), move(req));
+                retried = true;
+                continue;
+            }
+            finished.push_back(move(req));
+        }
+
+        // Callbacks may queue follow-up transfers, so run them after info_read.
+        for (auto& req : finished) {
+            if (req->onDone) req->onDone(*req);
+        }
+
+        bool added = !toAdd.empty();
+        for (auto& req : toAdd)
+            add(move(req));
+        toAdd.clear();
+
+        // Unpausing can run callbacks that ask for more resumes
+        bool resumed = false;
+        while (!toResume.empty()) {
+            vector<CURL*> handles;
+            handles.swap(toResume);
+            for (CURL* handle : handles) {
+                if (!active.count(handle)) continue;
+                curl_easy_pause(handle, CURLPAUSE_CONT);
+                resumed = true;
+            }
+        }
+
+        if (finished.empty() && !resumed && !added && !started && !retried && !empty()) {
+            int timeoutMs = int(min<long>(100, nextWakeMs(chrono::steady_clock::now())));
+            if (active.empty()) {
+                // Only paced or delayed requests left: nothing to poll on
+                this_thread::sleep_for(chrono::milliseconds(timeoutMs));
+            }
+            else {
+                curl_multi_poll(multi, nullptr, 0, timeoutMs, nullptr);
+            }
+        }
+    }
+
+private:
+    // Requests are paced per host and endpoint class: uploads, other Dropbox
+    // API calls, Sheets writes, Sheets reads, and each image host on its
+    // own. Each class has a token bucket and an AIMD window: a throttled
+    // answer halves the window (at most once per round trip), a success not
+    // much slower than the best seen grows it by 1/window, up to maxWindow,
+    // or up to the stream limit on a multiplexed host.
+    struct Endpoint {
+        double ratePerSecond = 0;
+        double tokens = 1;
+        chrono::steady_clock::time_point refilled;
+
+        double window = 0;
+        double ceiling = 0;
+        size_t inFlight = 0;
+        double bestLatencyMs = 0;
+        chrono::steady_clock::time_point lastDecrease;
+
+        deque<unique_ptr<HttpRequest>> waiting;
+    };
+
+    // The content host's endpoints: single uploads and the session calls.
+    // finish_batch_v2 shares the prefix but is an api-host call.
+    static bool contentPath(const string& path) {
+        return path == "/2/files/upload"
+            || path == "/2/files/upload_session/start"
+            || path == "/2/files/upload_session/append_v2"
+            || path == "/2/files/upload_session/finish";
+    }
+
+    Endpoint& endpointFor(const string& url) {
+        string host = hostKey(url);
+        string key;
+        unsigned long rate = 0;
+
+        const ServiceUrls& urls = serviceUrls();
+        string path = url.substr(host.size(), url.find_first_of("?#", host.size()) - host.size());
+
+        if (host == hostKey(urls.dropboxContent) && contentPath(path)) {
+            key = host + " upload";
+            rate = rates.uploadPerSecond;
+        }
+        else if (host == hostKey(urls.dropboxApi) || path.starts_with("/2/")) {
+            key = host + " api";
+            rate = rates.apiPerSecond;
+        }
+        else if (url.find("/v4/spreadsheets/") != string::npos) {
+            // Reads have a quota of their own
+            bool write = url.find("/values:batchUpdate") != string::npos;
+            key = host + (write ? " sheets" : " sheets read");
+            rate = rates.sheetsPerSecond;
+        }
+        else {
+            key = host;
+        }
+
+        auto found = endpoints.find(key);
+        if (found != endpoints.end())
+            return found->second;
+
+        Endpoint& endpoint = endpoints[key];
+        endpoint.ratePerSecond = double(rate);
+        endpoint.ceiling = double(rates.maxWindow);
+        if (transport.http2 && connectionPool().multiplexed(host))
+            endpoint.ceiling = double(min(rates.maxWindow, transport.maxStreams));
+        endpoint.window = endpoint.ceiling;
+        endpoint.refilled = chrono::steady_clock::now();
+        return endpoint;
+    }
+
+    // Starts whatever the endpoint's window and bucket allow.
+    bool dispatch(Endpoint& endpoint, chrono::steady_clock::time_point now) {
+        bool started = false;
+        refill(endpoint, now);
+
+        while (!endpoint.waiting.empty() && endpoint.inFlight < max<size_t>(1, size_t(endpoint.window))) {
+            if (endpoint.ratePerSecond > 0) {
+                if (endpoint.tokens < 1) break;
+                endpoint.tokens -= 1;
+            }
+
+            unique_ptr<HttpRequest> req = move(endpoint.waiting.front());
+            endpoint.waiting.pop_front();
+            --queued;
+            ++endpoint.inFlight;
+
+            req->startedAt = now;
+            CURL* handle = req->curl;
+            active[handle] = move(req);
+            curl_multi_add_handle(multi, handle);
+            started = true;
+        }
+        return started;
+    }
+
+    bool dispatchAll(chrono::steady_clock::time_point now) {
+        bool started = false;
+        for (auto& entry : endpoints) {
+            if (!entry.second.waiting.empty())
+                started |= dispatch(entry.second, now);
+        }
+        return started;
+    }
+
+    void refill(Endpoint& endpoint, chrono::steady_clock::time_point now) {
+        if (endpoint.ratePerSecond <= 0) return;
+
+        double elapsed = chrono::duration<double>(now - endpoint.refilled).count();
+        // Bucket holds a second's worth, at least one request
+        double capacity = max(1.0, endpoint.ratePerSecond);
+        endpoint.tokens = min(capacity, endpoint.tokens + elapsed * endpoint.ratePerSecond);
+        endpoint.refilled = now;
+    }
+
+    // Resends whose backoff has run out go back to the front of their queue.
+    bool releaseDelayed(chrono::steady_clock::time_point now) {
+        bool released = false;
+        while (!delayed.empty() && delayed.begin()->first <= now) {
+            unique_ptr<HttpRequest> req = move(delayed.begin()->second);
+            delayed.erase(delayed.begin());
+
+            Endpoint& endpoint = endpointFor(req->url);
+            req->queuedAt = now;
+            endpoint.waiting.push_front(move(req));
+            ++queued;
+            released = true;
+        }
+        return released;
+    }
+
+    void adjustWindow(Endpoint& endpoint, const HttpRequest& req) {
+        auto now = chrono::steady_clock::now();
+
+        if (throttled(req)) {
+            auto sinceDecrease = chrono::duration<double, milli>(now - endpoint.lastDecrease).count();
+            if (sinceDecrease < max(100.0, endpoint.bestLatencyMs))
+                return;
+            double flight = min(endpoint.window, double(endpoint.inFlight + 1));
+            endpoint.window = max(1.0, flight / 2);
+            endpoint.lastDecrease = now;
+            return;
+        }
+
+        if (!httpOk(req))
+            return;
+
+        double latencyMs = chrono::duration<double, milli>(now - req.startedAt).count();
+        if (endpoint.bestLatencyMs == 0 || latencyMs < endpoint.bestLatencyMs)
+            endpoint.bestLatencyMs = latencyMs;
+
+        // Queueing on the server side shows up as latency before it shows up as 429s
+        if (latencyMs <= 4 * endpoint.bestLatencyMs)
+            endpoint.window = min(endpoint.ceiling, endpoint.window + 1 / endpoint.window);
+    }
+
+    // Says once per host when --http2 asked for streams and the server
+    // answered over HTTP/1.1, so the run is not silently using more sockets.
+    void noteHttpVersion(const HttpRequest& req) {
+        if (!transport.http2 || req.result != CURLE_OK)
+            return;
+        // Shared by the bootstrap's loop and the row loop
+        static set<string> noted;
+        string host = hostKey(req.url);
+        if (!connectionPool().multiplexed(host) || !noted.insert(host).second)
+            return;
+        long version = 0;
+        curl_easy_getinfo(req.curl, CURLINFO_HTTP_VERSION, &version);
+        if (version != CURL_HTTP_VERSION_2_0)
+            cerr << "HTTP/2 not offered by " << host << ", using HTTP/1.1" << endl;
+    }
+
+    // -1 when the attempt stands; otherwise how long to wait before resending.
+    // Retry-After wins when the server sends it, else exponential backoff
+    // with jitter so throttled requests do not come back in lockstep.
+    long retryDelayMs(const HttpRequest& req) {
+        if (req.retry == RetryPolicy::Never || req.attempts >= rates.maxRetries)
+            return -1;
+
+        bool transient =
+            req.result == CURLE_COULDNT_CONNECT || req.result == CURLE_OPERATION_TIMEDOUT ||
+            req.result == CURLE_SEND_ERROR || req.result == CURLE_RECV_ERROR ||
+            req.result == CURLE_GOT_NOTHING ||
+            (req.result == CURLE_OK && (req.status == 500 || req.status == 502 || req.status == 504));
+
+        if (!throttled(req) && !(transient && req.retry == RetryPolicy::Any))
+            return -1;
+
+        uniform_int_distribution<long> jitter(0, 250);
+        string retryAfter = headerValue(req.responseHeaders, "Retry-After");
+        if (!retryAfter.empty() && isdigit((unsigned char)retryAfter[0]))
+            return min(rates.maxBackoffMs, strtol(retryAfter.c_str(), nullptr, 10) * 1000) + jitter(random);
+
+        long backoff = min(rates.maxBackoffMs, rates.baseBackoffMs << min(req.attempts, 16));
+        uniform_int_distribution<long> spread(backoff / 2, backoff);
+        return spread(random);
+    }
+
+    // Until the next delayed resend is due or a paced endpoint has a token.
+    long nextWakeMs(chrono::steady_clock::time_point now) const {
+        long wake = 100;
+        if (!delayed.empty()) {
+            wake = min<long>(wake, max<long>(1, long(chrono::duration_cast<chrono::milliseconds>(
+                delayed.begin()->first - now).count())));
+        }
+        for (auto& entry : endpoints) {
+            const Endpoint& endpoint = entry.second;
+            if (endpoint.waiting.empty() || endpoint.ratePerSecond <= 0 || endpoint.tokens >= 1)
+                continue;
+            wake = min<long>(wake, max<long>(1, long((1 - endpoint.tokens) * 1000 / endpoint.ratePerSecond)));
+        }
+        return wake;
+    }
+
+    CURLM* multi;
+    RateOptions rates;
+    TransportOptions transport;
+    mt19937 random;
+
+    unordered_map<CURL*, unique_ptr<HttpRequest>> active;
+    unordered_map<string, Endpoint> endpoints;
+    size_t queued = 0;      // waiting across all endpoints
+    multimap<chrono::steady_clock::time_point, unique_ptr<HttpRequest>> delayed;
+    vector<CURL*> toResume;
+    vector<unique_ptr<HttpRequest>> toAdd;
+};
+
+// --- CSV export ---
+
+unique_ptr<HttpRequest> makeDownloadCSVRequest(const string& csvUrl) {
+
+    cout << "URL = [" << csvUrl << "]" << endl;
+
+    auto req = make_unique<HttpRequest>(csvUrl, "csv");
+    CURL* curl = req->curl;
+    if (!curl) return nullptr;
+
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeToString);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V4);
+
+    return req;
+}
+
+bool finishDownloadCSV(HttpRequest& req, string& csvData) {
+    if (!httpOk(req)) {
+        cerr << "Curl error: " << httpError(req) << endl;
+        return false;
+    }
+
+    csvData = move(req.response);
+    return true;
+}
+
+// --- CSV ---
+// The export is indexed in one pass: every cell is an (offset, length) span
+// into the downloaded text, so any cell is found in O(1) without copying the
+// sheet. Quoted fields (commas, newlines and "" inside quotes) follow RFC
+// 4180. Edits are kept on the side and only the edited rows are rebuilt when
+// the table is written back out.
+//
+// The text can also arrive in pieces as it downloads (--stream-csv): each
+// append() indexes the records it completes, and release() drops rows that
+// have been written out, along with their text, so only a window of the
+// sheet is held at a time. Row numbers stay those of the whole export.
+// A field as RFC 4180 wants it: quoted only when it has to be.
+void writeCsvField(ostream& out, string_view value) {
+    if (value.find_first_of(",\"\r\n") == string_view::npos) {
+        out << value;
+        return;
+    }
+
+    out << '"';
+    for (char c : value) {
+        if (c == '"') out << '"';
+        out << c;
+    }
+    out << '"';
+}
+
+class CsvTable {
+public:
+    // Filled as the export downloads, through append() and finish()
+    CsvTable() = default;
+
+    // The whole export at once
+    explicit CsvTable(string text) : buffer(move(text)) { finish(); }
+
+    void append(string_view bytes) {
+        buffer.append(bytes);
+        parse(false);
+    }
+
+    // End of the export: a last record without a line break counts too.
+    void finish() {
+        parse(true);
+        complete = true;
+    }
+
+    bool finished() const { return complete; }
+
+    // Rows indexed so far, released ones included
+    size_t rowCount() const { return firstRow + lines.size(); }
+
+    // Rows indexed and not yet released, the header (row 0) aside: it
+    // stays until the first row is written out behind it.
+    size_t heldRows() const { return lines.size() - (firstRow == 0 && !lines.empty() ? 1 : 0); }
+
+    size_t columnCount(size_t row) const {
+        if (row < firstRow || row >= rowCount()) return 0;
+        size_t r = row - firstRow;
+        size_t end = r + 1 < rowStart.size() ? rowStart[r + 1] : firstCell + cells.size();
+        return end - rowStart[r];
+    }
+
+    // The field exactly as it appears in the file, quotes included
+    string_view raw(size_t row, size_t col) const {
+        if (col >= columnCount(row)) return {};
+        return textOf(span(row, col));
+    }
+
+    // The field's value: edited value if any, otherwise unquoted; "" if missing
+    string cell(size_t row, size_t col) const {
+        auto edit = edits.find(editKey(row, col));
+        if (edit != edits.end()) return edit->second;
+
+        if (col >= columnCount(row)) return "";
+        const Span& field = span(row, col);
+        string_view text = textOf(field);
+        if (!field.quoted) return string(text);
+
+        size_t close = text.rfind('"');
+        text = text.substr(1, close > 0 ? close - 1 : text.size() - 1);
+
+        string value;
+        value.reserve(text.size());
+        for (size_t k = 0; k < text.size(); ++k) {
+            value += text[k];
+            if (text[k] == '"' && k + 1 < text.size() && text[k + 1] == '"') ++k;
+        }
+        return value;
+    }
+
+    void set(size_t row, size_t col, const string& value) {
+        edits[editKey(row, col)] = value;
+        editedRows[row] = max(editedRows[row], col + 1);
+    }
+
+    // Unedited rows are written back verbatim; edited rows are rebuilt from
+    // their raw fields with the edited ones substituted.
+    void writeRow(ostream& out, size_t row) const {
+        if (row < firstRow || row >= rowCount()) return;
+        auto edited = editedRows.find(row);
+        if (edited == editedRows.end()) {
+            out << textOf(lines[row - firstRow]);
+            return;
+        }
+
+        size_t columns = max(columnCount(row), edited->second);
+        for (size_t col = 0; col < columns; ++col) {
+            if (col > 0) out << ",";
+            auto edit = edits.find(editKey(row, col));
+            if (edit != edits.end()) writeCsvField(out, edit->second);
+            else out << raw(row, col);
+        }
+    }
+
+    // Drops every row before `row`, with its edits; they must not be asked
+    // for again. The text goes once it is at least half the buffer.
+    void release(size_t row) {
+        while (firstRow < row && !lines.empty()) {
+            size_t next = rowStart.size() > 1 ? rowStart[1] : firstCell + cells.size();
+            cells.erase(cells.begin(), cells.begin() + (next - firstCell));
+            firstCell = next;
+            rowStart.pop_front();
+            lines.pop_front();
+
+            auto edited = editedRows.find(firstRow);
+            if (edited != editedRows.end()) {
+                for (size_t col = 0; col < edited->second; ++col)
+                    edits.erase(editKey(firstRow, col));
+                editedRows.erase(edited);
+            }
+            ++firstRow;
+        }
+
+        size_t keep = lines.empty() ? parsed : lines.front().offset;
+        if (keep - base >= buffer.size() / 2) {
+            buffer.erase(0, keep - base);
+            base = keep;
+        }
+    }
+
+private:
+    struct Span {
+        size_t offset;          // in the whole export
+        uint32_t length;
+        bool quoted;
+    };
+
+    // Indexes the records after `parsed`. Until the export is final, one
+    // that runs into the end of the text waits for more of it.
+    void parse(bool final) {
+        string_view text(buffer);
+        size_t n = text.size();
+        size_t pos = parsed - base;
+
+        while (pos < n) {
+            size_t cellCount = cells.size();
+            size_t lineStart = pos;
+
+            for (;;) {
+                size_t start = pos;
+                bool quoted = pos < n && text[pos] == '"';
+
+                if (quoted) {
+                    ++pos;
+                    while (pos < n) {
+                        if (text[pos] == '"') {
+                            if (pos + 1 < n && text[pos + 1] == '"') {
+                                pos += 2;
+                                continue;
+                            }
+                            ++pos;
+                            break;
+                        }
+                        ++pos;
+                    }
+                }
+
+                // Unquoted field, or anything stray after a closing quote
+                while (pos < n && text[pos] != ',' && text[pos] != '\n' && text[pos] != '\r')
+                    ++pos;
+
+                cells.push_back({ base + start, uint32_t(pos - start), quoted });
+
+                if (pos < n && text[pos] == ',') {
+                    ++pos;
+                    continue;
+                }
+                break;
+            }
+
+            // A \r at the very end may still have its \n coming
+            bool ended = pos + 1 < n || (pos < n && text[pos] == '\n');
+            if (!ended && !final) {
+                cells.resize(cellCount);
+                break;
+            }
+
+            rowStart.push_back(firstCell + cellCount);
+            lines.push_back({ base + lineStart, uint32_t(pos - lineStart), false });
+
+            if (pos < n && text[pos] == '\r') ++pos;
+            if (pos < n && text[pos] == '\n') ++pos;
+            parsed = base + pos;
+        }
+    }
+
+    const Span& span(size_t row, size_t col) const {
+        return cells[rowStart[row - firstRow] - firstCell + col];
+    }
+
+    string_view textOf(const Span& span) const {
+        return string_view(buffer).substr(span.offset - base, span.length);
+    }
+
+    static uint64_t editKey(size_t row, size_t col) {
+        return (uint64_t(row) << 16) | uint64_t(col);
+    }
+
+    string buffer;              // the export from offset base on
+    size_t base = 0;
+    size_t parsed = 0;          // where the next record starts
+    bool complete = false;
+
+    deque<Span> cells;          // row-major, from cell firstCell on
+    deque<size_t> rowStart;     // first cell of each held row
+    deque<Span> lines;          // each held record without its line terminator
+    size_t firstRow = 0;
+    size_t firstCell = 0;
+
+    unordered_map<uint64_t, string> edits;
+    unordered_map<size_t, size_t> editedRows;   // row -> columns needed
+};
+
+// --- Sheet reads ---
+// --read-sheet takes the rows from the Sheets values:batchGet endpoint
+// instead of the published CSV export: only the columns the job uses, from
+// the live sheet, a block of rows per request, gzipped. The tab's row count
+// is asked for first so that no block reaches past the grid, which Sheets
+// refuses. Each block comes back as CSV text with the columns in their
+// usual places and the others left empty, so the rest of the run cannot
+// tell the difference.
+
+struct SheetReadOptions {
+    bool enabled = false;
+    size_t blockRows = 10000;       // --read-block
+};
+
+// A1 notation wants anything but a plain name quoted, with ' doubled.
+string tabReference(const string& tab) {
+    bool plain = !tab.empty() && all_of(tab.begin(), tab.end(),
+        [](char c) { return isalnum((unsigned char)c) || c == '_'; });
+    if (plain)
+        return tab;
+
+    string quoted = "'";
+    for (char c : tab) {
+        if (c == '\'') quoted += '\'';
+        quoted += c;
+    }
+    return quoted + "'";
+}
+
+unique_ptr<HttpRequest> makeSheetReadRequest(const string& url, const string& accessToken) {
+    auto req = make_unique<HttpRequest>(url, "sheet_read");
+    if (!req->curl) return nullptr;
+
+    CURL* curl = req->curl;
+    struct curl_slist*& headers = req->headers;
+    headers = curl_slist_append(headers, ("Authorization: Bearer " + accessToken).c_str());
+
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    // Google only compresses for clients that say gzip in the User-Agent too
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "gzip");
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "uploader (gzip)");
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeToString);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+
+    return req;
+}
+
+// Titles and grid sizes of the spreadsheet's tabs.
+unique_ptr<HttpRequest> makeSheetGridRequest(const string& sheetId, const string& accessToken) {
+    return makeSheetReadRequest(serviceUrls().sheets + "/v4/spreadsheets/" + urlEncode(sheetId)
+        + "?fields=" + urlEncode("sheets.properties(title,gridProperties.rowCount)"), accessToken);
+}
+
+bool readSheetRowCount(HttpRequest& req, const string& tab, size_t& rowCount, ostream& log = cerr) {
+    if (!httpOk(req)) {
+        log << "Sheet read failed: " << httpError(req) << "\n" << req.response << endl;
+        return false;
+    }
+
+    JsonElements sheets(jsonMember(req.response, "sheets"));
+    for (string_view sheet; sheets.next(sheet);) {
+        string_view properties = jsonMember(sheet, "properties");
+        if (jsonString(jsonMember(properties, "title")) != tab)
+            continue;
+        rowCount = size_t(jsonNumber(jsonMember(properties, { "gridProperties", "rowCount" })));
+        return true;
+    }
+    log << "No tab named " << tab << " in the sheet" << endl;
+    return false;
+}
+
+// Rows [firstRow, firstRow + rows) of each column, counted from 0; one
+// range per column, in the order given.
+unique_ptr<HttpRequest> makeSheetValuesRequest(
+    const string& sheetId,
+    const string& tab,
+    const vector<int>& columns,
+    size_t firstRow,
+    size_t rows,
+    const string& accessToken)
+{
+    string url = serviceUrls().sheets + "/v4/spreadsheets/" + urlEncode(sheetId)
+        + "/values:batchGet?majorDimension=COLUMNS&valueRenderOption=FORMATTED_VALUE";
+    string prefix = tabReference(tab) + "!";
+    for (int col : columns) {
+        url += "&ranges=" + urlEncode(prefix + "R" + to_string(firstRow + 1) + "C" + to_string(col + 1)
+            + ":R" + to_string(firstRow + rows) + "C" + to_string(col + 1));
+    }
+    return makeSheetReadRequest(url, accessToken);
+}
+
+// Appends the block to csv. Inside the sheet empty rows keep their place,
+// but the sheet stops at its last row with a value, as the export does: empty
+// rows are counted in blankRows, across blocks, and only written once a row
+// with a value follows them.
+bool readSheetValues(HttpRequest& req, const vector<int>& columns, size_t rows,
+    string& csv, size_t& blankRows, ostream& log = cerr)
+{
+    if (!httpOk(req)) {
+        log << "Sheet read failed: " << httpError(req) << "\n" << req.response << endl;
+        return false;
+    }
+
+    // One list of cells per column, in request order
+    vector<vector<string>> cells;
+    size_t height = 0;
+    JsonElements ranges(jsonMember(req.response, "valueRanges"));
+    for (string_view range; ranges.next(range);) {
+        cells.emplace_back();
+        JsonElements majors(jsonMember(range, "values"));
+        string_view column;
+        if (majors.next(column)) {
+            JsonElements values(column);
+            for (string_view value; values.next(value);)
+                cells.back().push_back(jsonString(value));
+        }
+        height = max(height, cells.back().size());
+    }
+    if (cells.size() != columns.size()) {
+        log << "Unexpected sheet read response: " << req.response << endl;
+        return false;
+    }
+
+    int width = *max_element(columns.begin(), columns.end()) + 1;
+    ostringstream out;
+    if (height > 0) {
+        for (; blankRows > 0; --blankRows)
+            out << string(size_t(width - 1), ',') << '\n';
+    }
+    for (size_t r = 0; r < height; ++r) {
+        for (int col = 0; col < width; ++col) {
+            if (col > 0) out << ',';
+            auto which = find(columns.begin(), columns.end(), col);
+            size_t k = size_t(which - columns.begin());
+            if (which != columns.end() && r < cells[k].size())
+                writeCsvField(out, cells[k][r]);
+        }
+        out << '\n';
+    }
+    blankRows += rows - min(height, rows);
+    csv += out.str();
+    return true;
+}
+
+// --stream-csv=PATH: rows start as soon as the export delivers them and the
+// updated CSV goes to PATH in row order as they finish, rather than to stdout
+// at the end. At most a window of rows is held; the export download pauses
+// while the window is full.
+struct CsvStreamOptions {
+    string outPath;
+    size_t window = 256;            // --reorder-window
+    bool enabled() const { return !outPath.empty(); }
+};
+
+// Downloads an export straight into a CsvTable, or with --read-sheet the
+// sheet's values a block at a time; the next block is asked for once the
+// table has room, so it holds at most a window plus a block.
+class CsvFeed {
+public:
+    CsvFeed(CsvTable& table, size_t window) : table(table), window(window) {}
+
+    void start(TransferLoop& loop, const string& csvUrl) {
+        this->loop = &loop;
+        unique_ptr<HttpRequest> req = makeDownloadCSVRequest(csvUrl);
+        if (!req) {
+            table.finish();
+            return;
+        }
+
+        request = req.get();
+        curl_easy_setopt(req->curl, CURLOPT_WRITEFUNCTION, writeCallback);
+        curl_easy_setopt(req->curl, CURLOPT_WRITEDATA, this);
+        req->onDone = [this](HttpRequest& done) {
+            request = nullptr;
+            paused = false;
+            if (!httpOk(done))
+                cerr << "Curl error: " << httpError(done) << endl;
+            ok = httpOk(done) && table.rowCount() > 0;
+            table.finish();
+        };
+        loop.add(move(req));
+    }
+
+    void startSheet(TransferLoop& loop, const string& sheetId, const string& tab, vector<int> columns,
+        size_t blockRows, const string& accessToken)
+    {
+        this->loop = &loop;
+        sheet = { sheetId, tab, move(columns), blockRows, accessToken };
+
+        unique_ptr<HttpRequest> req = makeSheetGridRequest(sheetId, accessToken);
+        if (!req) {
+            table.finish();
+            return;
+        }
+        request = req.get();
+        req->onDone = [this](HttpRequest& done) {
+            request = nullptr;
+            if (!readSheetRowCount(done, sheet.tab, sheet.rowCount)) {
+                table.finish();
+                return;
+            }
+            sheet.more = sheet.rowCount > 0;
+            if (sheet.more) readBlock();
+            else table.finish();
+        };
+        this->loop->add(move(req));
+    }
+
+    // Picks the download up again once rows have been written out.
+    void tick() {
+        if (paused && request && table.heldRows() < window) {
+            paused = false;
+            loop->resume(request->curl);
+        }
+        if (sheet.more && !request && table.heldRows() < window)
+            readBlock();
+    }
+
+    bool succeeded() const { return ok; }
+
+private:
+    struct SheetSource {
+        string sheetId;
+        string tab;
+        vector<int> columns;
+        size_t blockRows = 0;
+        string accessToken;
+        size_t rowCount = 0;        // of the tab's grid
+        size_t nextRow = 0;
+        size_t blankRows = 0;       // empty rows not yet written
+        bool more = false;
+    };
+
+    void readBlock() {
+        size_t rows = min(sheet.blockRows, sheet.rowCount - sheet.nextRow);
+        bool last = sheet.nextRow + rows >= sheet.rowCount;
+        unique_ptr<HttpRequest> req = makeSheetValuesRequest(sheet.sheetId, sheet.tab, sheet.columns,
+            sheet.nextRow, rows, sheet.accessToken);
+        if (!req) {
+            sheet.more = false;
+            table.finish();
+            return;
+        }
+
+        request = req.get();
+        req->onDone = [this, rows, last](HttpRequest& done) {
+            request = nullptr;
+            string csv;
+            if (!readSheetValues(done, sheet.columns, rows, csv, sheet.blankRows)) {
+                sheet.more = false;
+                table.finish();
+                return;
+            }
+            table.append(csv);
+            sheet.nextRow += rows;
+            sheet.more = !last;
+            if (last) {
+                ok = table.rowCount() > 0;
+                table.finish();
+            }
+        };
+        loop->add(move(req));
+    }
+
+    static size_t writeCallback(void* contents, size_t size, size_t nmemb, void* userp) {
+        CsvFeed& feed = *static_cast<CsvFeed*>(userp);
+        size_t total = size * nmemb;
+
+        // An error page is not the export
+        long status = 0;
+        curl_easy_getinfo(feed.request->curl, CURLINFO_RESPONSE_CODE, &status);
+        if (status >= 400)
+            return total;
+
+        if (feed.table.heldRows() >= feed.window) {
+            feed.paused = true;
+            return CURL_WRITEFUNC_PAUSE;
+        }
+
+        // Rows already handed out cannot be taken back by a resend
+        feed.request->retry = RetryPolicy::Never;
+        feed.table.append(string_view(static_cast<char*>(contents), total));
+        return total;
+    }
+
+    CsvTable& table;
+    size_t window;
+    TransferLoop* loop = nullptr;
+    HttpRequest* request = nullptr;     // while the download is in flight
+    bool paused = false;
+    bool ok = false;
+    SheetSource sheet;                  // --read-sheet
+};
+
+// Dropbox path_lower form of a path.
+string lowercase(string s) {
+    for (char& c : s) c = char(tolower((unsigned char)c));
+    return s;
+}
+
+// FNV-1a over fields, with a separator so ("ab", "c") != ("a", "bc").
+uint64_t fnv1a(initializer_list<string_view> fields) {
+    uint64_t hash = 14695981039346656037ull;
+    for (string_view field : fields) {
+        for (char c : field) {
+            hash ^= (unsigned char)c;
+            hash *= 1099511628211ull;
+        }
+        hash ^= 0x1f;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+bool needsProcessing(const string& cell) {
+    string c = trim(cell);
+
+    if (c.empty())
+        return false;
+
+    if (c.find("dropbox.com") != string::npos)
+        return false;
+
+    return c.rfind("http", 0) == 0;
+}
+
+size_t writeTextCallback(void* contents, size_t size, size_t nmemb, void* userp)
+{
+    size_t total = size * nmemb;
+    std::string* s = static_cast<std::string*>(userp);
+    s->append(static_cast<char*>(contents), total);
+    return total;
+}
+
+size_t writeBinaryCallback(void* contents, size_t size, size_t nmemb, void* userp)
+{
+    size_t totalSize = size * nmemb;
+    string* buffer = static_cast<string*>(userp);
+    buffer->append(static_cast<char*>(contents), totalSize);
+    return totalSize;
+}
+
+void addDropboxBusinessHeaders(
+    struct curl_slist*& headers,
+    const string& accessToken
+) {
+    headers = curl_slist_append(headers,
+        ("Authorization: Bearer " + accessToken).c_str());
+
+    headers = curl_slist_append(headers,
+        ("Dropbox-API-Select-User: " +
+            string(DROPBOX_TEAM_MEMBER_ID)).c_str());
+}
+
+void addDropboxNamespaceHeader(struct curl_slist*& headers) {
+    string header = "Dropbox-API-Path-Root: ";
+    JsonWriter(header, true).beginObject()
+        .key(".tag").value("namespace_id")
+        .key("namespace_id").value(DROPBOX_NAMESPACE_ID)
+        .endObject();
+
+    headers = curl_slist_append(headers, header.c_str());
+}
+
+// --- Payload buffers ---
+
+struct MemoryOptions {
+    size_t budgetBytes = 256 * 1024 * 1024;     // --memory-budget
+    size_t spillBytes = 16 * 1024 * 1024;       // --spill-threshold
+    string spillDir;                            // --spill-dir, else $TMPDIR or /tmp
+};
+
+// Bytes of image payload the rows may hold in memory at once. A download
+// reserves what it could buffer before spilling and keeps only what it ends
+// up holding; new downloads wait while the budget is spoken for. The first
+// reservation always succeeds so a budget below one payload cannot stall.
+class PayloadBudget {
+public:
+    explicit PayloadBudget(const MemoryOptions& options) : options(options) {}
+
+    bool reserve(size_t bytes) {
+        if (used > 0 && used + bytes > options.budgetBytes)
+            return false;
+        used += bytes;
+        return true;
+    }
+
+    void release(size_t bytes) { used -= min(used, bytes); }
+
+    size_t spillBytes() const { return options.spillBytes; }
+
+private:
+    const MemoryOptions& options;
+    size_t used = 0;
+};
+
+// An image body: on the heap while small, otherwise written to an unlinked
+// temp file and mapped back read-only once complete, so the upload sends
+// the file's pages as they are instead of a heap copy.
+class Payload {
+public:
+    Payload() = default;
+    Payload(const Payload&) = delete;
+    Payload& operator=(const Payload&) = delete;
+    ~Payload() { clear(); }
+
+    void spillTo(const MemoryOptions& memory) { options = &memory; }
+
+    // False when a spill write fails.
+    bool append(const char* data, size_t size) {
+        if (fd < 0 && options && memory.size() + size > options->spillBytes && !spill())
+            return false;
+        if (fd < 0) {
+            memory.append(data, size);
+            return true;
+        }
+        return writeAll(data, size);
+    }
+
+    // Maps a spilled body back in; call once the body is complete.
+    bool seal() {
+        if (fd < 0 || mapped || fileSize == 0)
+            return true;
+        void* mapping = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED)
+            return false;
+        // Read once, front to back, by the upload
+        madvise(mapping, fileSize, MADV_SEQUENTIAL);
+        mapped = static_cast<const char*>(mapping);
+        return true;
+    }
+
+    string_view view() const { return fd < 0 ? string_view(memory) : string_view(mapped, mapped ? fileSize : 0); }
+    size_t size() const { return fd < 0 ? memory.size() : fileSize; }
+    bool empty() const { return size() == 0; }
+    bool spilled() const { return fd >= 0; }
+
+    void clear() {
+        memory = string();
+        if (mapped) munmap(const_cast<char*>(mapped), fileSize);
+        if (fd >= 0) ::close(fd);
+        mapped = nullptr;
+        fd = -1;
+        fileSize = 0;
+    }
+
+private:
+    bool spill() {
+        string dir = options->spillDir;
+        if (dir.empty()) {
+            const char* tmp = getenv("TMPDIR");
+            dir = tmp && *tmp ? tmp : "/tmp";
+        }
+        string path = dir + "/uploader-XXXXXX";
+        fd = mkstemp(path.data());
+        if (fd < 0)
+            return false;
+        // Nothing to clean up later, even after a crash
+        unlink(path.c_str());
+
+        string held = move(memory);
+        memory = string();
+        return writeAll(held.data(), held.size());
+    }
+
+    bool writeAll(const char* data, size_t size) {
+        while (size > 0) {
+            ssize_t n = ::write(fd, data, size);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += n;
+            size -= size_t(n);
+            fileSize += size_t(n);
+        }
+        return true;
+    }
+
+    const MemoryOptions* options = nullptr;
+    string memory;
+    int fd = -1;
+    size_t fileSize = 0;
+    const char* mapped = nullptr;
+};
+
+// --- Image checks ---
+
+struct ImageLimits {
+    size_t maxBytes = 100 * 1024 * 1024;    // --max-image-bytes
+};
+
+// Extensions a sniffed image can get; ".jpg" is what a bare name defaults to.
+const char* const IMAGE_EXTENSIONS[] = { ".jpg", ".png", ".gif", ".webp", ".bmp", ".tif", ".ico", ".heic", ".avif", ".svg" };
+
+// File extension for the format in the first bytes of a body, or "" when
+// no known image format matches. SVG is text, so only its Content-Type
+// can name it.
+string imageExtension(string_view head, string_view contentType)
+{
+    auto at = [&](size_t offset, string_view magic) {
+        return head.size() >= offset + magic.size() && head.substr(offset, magic.size()) == magic;
+    };
+
+    if (at(0, "\xFF\xD8\xFF")) return ".jpg";
+    if (at(0, "\x89PNG\r\n\x1A\n")) return ".png";
+    if (at(0, "GIF87a") || at(0, "GIF89a")) return ".gif";
+    if (at(0, "RIFF") && at(8, "WEBP")) return ".webp";
+    if (at(0, "BM")) return ".bmp";
+    if (at(0, string_view("II*\0", 4)) || at(0, string_view("MM\0*", 4))) return ".tif";
+    if (at(0, string_view("\0\0\1\0", 4))) return ".ico";
+    if (at(4, "ftyp")) {
+        if (at(8, "avif") || at(8, "avis")) return ".avif";
+        if (at(8, "heic") || at(8, "heix") || at(8, "mif1")) return ".heic";
+    }
+    if (lowercase(string(contentType)).rfind("image/svg+xml", 0) == 0) return ".svg";
+    return "";
+}
+
+// Watches an image download as it arrives and stops it as soon as it is
+// clearly not a usable image: a page or video Content-Type, more bytes than
+// the limit, or first bytes that match no image format. Error statuses are
+// let through untouched so the transfer can still be retried on them.
+class ImageCheck {
+public:
+    explicit ImageCheck(const ImageLimits& limits) : limits(limits) {}
+
+    size_t maxBytes() const { return limits.maxBytes; }
+
+    // body is where the bytes end up, or null when the caller keeps them.
+    void attach(const HttpRequest& req, Payload* sink) {
+        request = &req;
+        body = sink;
+        attempt = req.attempts;
+        reset();
+    }
+
+    // False once the transfer should be cut off; reason() says why.
+    bool accept(const char* data, size_t size) {
+        // A resend starts the body over
+        if (request->attempts != attempt) {
+            attempt = request->attempts;
+            if (body) body->clear();
+            reset();
+        }
+
+        long status = 0;
+        curl_easy_getinfo(request->curl, CURLINFO_RESPONSE_CODE, &status);
+        if (status >= 400)
+            return true;
+
+        if (bytes == 0 && !checkHeaders())
+            return false;
+
+        bytes += size;
+        if (bytes > limits.maxBytes)
+            return reject("larger than " + to_string(limits.maxBytes) + " bytes");
+
+        if (extension_.empty() && head.size() < SNIFF_BYTES) {
+            head.append(data, min(size, SNIFF_BYTES - head.size()));
+            if (head.size() == SNIFF_BYTES)
+                return sniff();
+        }
+        return true;
+    }
+
+    // Verdict once the transfer is over: sniffs a body that ended inside the
+    // window and notes a size cut libcurl made itself from Content-Length.
+    bool finish(CURLcode result) {
+        if (result == CURLE_FILESIZE_EXCEEDED)
+            return reject("larger than " + to_string(limits.maxBytes) + " bytes");
+        if (result != CURLE_OK || !reason_.empty())
+            return false;
+        return !extension_.empty() || sniff();
+    }
+
+    bool decided() const { return !extension_.empty() || !reason_.empty(); }
+    const string& extension() const { return extension_; }
+    const string& reason() const { return reason_; }
+    Payload* sink() const { return body; }
+
+private:
+    static constexpr size_t SNIFF_BYTES = 12;
+
+    bool checkHeaders() {
+        const char* type = nullptr;
+        curl_easy_getinfo(request->curl, CURLINFO_CONTENT_TYPE, &type);
+        contentType = type ? lowercase(type) : string();
+
+        if (contentType.rfind("text/html", 0) == 0 || contentType.rfind("application/xhtml", 0) == 0 ||
+            contentType.find("json") != string::npos ||
+            contentType.rfind("video/", 0) == 0 || contentType.rfind("audio/", 0) == 0)
+        {
+            return reject("not an image: Content-Type " + contentType);
+        }
+
+        curl_off_t length = -1;
+        curl_easy_getinfo(request->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        if (length > 0 && size_t(length) > limits.maxBytes)
+            return reject("larger than " + to_string(limits.maxBytes) + " bytes");
+        return true;
+    }
+
+    bool sniff() {
+        extension_ = imageExtension(head, contentType);
+        if (extension_.empty())
+            return reject("not an image: unrecognised content" +
+                (contentType.empty() ? string() : ", Content-Type " + contentType));
+        return true;
+    }
+
+    bool reject(string why) {
+        reason_ = move(why);
+        return false;
+    }
+
+    void reset() {
+        bytes = 0;
+        head.clear();
+        contentType.clear();
+        extension_.clear();
+        reason_.clear();
+    }
+
+    const ImageLimits& limits;
+    const HttpRequest* request = nullptr;
+    Payload* body = nullptr;
+    int attempt = 0;
+    size_t bytes = 0;
+    string head;
+    string contentType;
+    string extension_;
+    string reason_;
+};
+
+size_t imageWriteCallback(void* contents, size_t size, size_t nmemb, void* userp)
+{
+    size_t total = size * nmemb;
+    ImageCheck* check = static_cast<ImageCheck*>(userp);
+    if (!check->accept(static_cast<char*>(contents), total))
+        return 0;
+    return check->sink()->append(static_cast<char*>(contents), total) ? total : 0;
+}
+
+// Validators from the last download of a URL, sent back so an unchanged
+// image comes back as a bodiless 304.
+struct DownloadValidators {
+    string etag;
+    string lastModified;
+
+    bool empty() const { return etag.empty() && lastModified.empty(); }
+};
+
+// The body goes to imageData, through check.
+unique_ptr<HttpRequest> makeDownloadImageRequest(
+    const string& imageUrl,
+    ImageCheck& check,
+    Payload& imageData,
+    const DownloadValidators* validators = nullptr)
+{
+    auto req = make_unique<HttpRequest>(imageUrl, "image");
+    if (!req->curl) return nullptr;
+
+    CURL* curl = req->curl;
+    imageData.clear();
+    check.attach(*req, &imageData);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, imageWriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &check);
+    curl_easy_setopt(curl, CURLOPT_MAXFILESIZE_LARGE, curl_off_t(check.maxBytes()));
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_MAXREDIRS, 5L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+
+    if (validators) {
+        struct curl_slist*& headers = req->headers;
+        if (!validators->etag.empty())
+            headers = curl_slist_append(headers, ("If-None-Match: " + validators->etag).c_str());
+        if (!validators->lastModified.empty())
+            headers = curl_slist_append(headers, ("If-Modified-Since: " + validators->lastModified).c_str());
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    }
+
+    return req;
+}
+
+DownloadValidators downloadValidators(const HttpRequest& req)
+{
+    return { headerValue(req.responseHeaders, "ETag"), headerValue(req.responseHeaders, "Last-Modified") };
+}
+
+bool finishDownloadImage(HttpRequest& req, ImageCheck& check, Payload& imageData)
+{
+    if (req.result == CURLE_OK && req.status >= 400)
+        return false;
+    return check.finish(req.result) && !imageData.empty() && imageData.seal();
+}
+
+// Points the request's POST data at body without copying it. The bytes
+// belong to the caller and must stay put until the transfer is done.
+void setPostBody(HttpRequest& req, string_view body) {
+    curl_easy_setopt(req.curl, CURLOPT_POSTFIELDS, body.data());
+    curl_easy_setopt(req.curl, CURLOPT_POSTFIELDSIZE_LARGE, curl_off_t(body.size()));
+}
+
+// Content endpoint request (files/upload, upload_session/*) without a body
+// source; callers attach one with setPostBody or a read callback.
+unique_ptr<HttpRequest> makeDropboxContentRequest(
+    const string& accessToken,
+    const string& url,
+    const string& apiArg)
+{
+    auto req = make_unique<HttpRequest>(url, "upload");
+    if (!req->curl) {
+        cerr << "[uploadToDropbox] CURL init failed\n";
+        return nullptr;
+    }
+
+    CURL* curl = req->curl;
+    struct curl_slist*& headers = req->headers;
+    // A lost response may still have stored the file; only a refusal is safe to resend
+    req->retry = RetryPolicy::ThrottleOnly;
+
+    addDropboxBusinessHeaders(headers, accessToken);
+    addDropboxNamespaceHeader(headers);
+
+    headers = curl_slist_append(headers,
+        "Content-Type: application/octet-stream");
+
+    headers = curl_slist_append(headers,
+        ("Dropbox-API-Arg: " + apiArg).c_str());
+
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeTextCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+
+    return req;
+}
+
+// CommitInfo for a new file at dropboxPath; a clash gets a numbered name.
+void writeCommitInfo(JsonWriter& json, const string& dropboxPath) {
+    json.beginObject()
+        .key("path").value(dropboxPath)
+        .key("mode").value("add")
+        .key("autorename").boolean(true)
+        .key("mute").boolean(false)
+        .endObject();
+}
+
+unique_ptr<HttpRequest> makeDropboxUploadRequest(
+    const string& accessToken,
+    const string& dropboxPath)
+{
+    string apiArg;
+    JsonWriter json(apiArg, true);
+    writeCommitInfo(json, dropboxPath);
+
+    return makeDropboxContentRequest(accessToken,
+        serviceUrls().dropboxContent + "/2/files/upload", apiArg);
+}
+
+unique_ptr<HttpRequest> makeUploadRequest(
+    const string& accessToken,
+    string_view fileData,
+    const string& dropboxPath)
+{
+    auto req = makeDropboxUploadRequest(accessToken, dropboxPath);
+    if (!req) return nullptr;
+
+    setPostBody(*req, fileData);
+
+    return req;
+}
+
+// --- Content hashing ---
+// Dropbox content_hash: SHA-256 of each 4 MiB block, then SHA-256 of the
+// concatenated block digests, as lowercase hex.
+
+class Sha256 {
+public:
+    Sha256() { reset(); }
+
+    void reset() {
+        static const uint32_t init[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+        memcpy(state, init, sizeof(state));
+        length = 0;
+        buffered = 0;
+    }
+
+    void update(const void* data, size_t len) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        length += len;
+
+        if (buffered > 0) {
+            size_t take = min(len, sizeof(block) - buffered);
+            memcpy(block + buffered, p, take);
+            buffered += take;
+            p += take;
+            len -= take;
+            if (buffered < sizeof(block)) return;
+            compress(block);
+            buffered = 0;
+        }
+
+        for (; len >= sizeof(block); p += sizeof(block), len -= sizeof(block))
+            compress(p);
+
+        memcpy(block, p, len);
+        buffered = len;
+    }
+
+    void finish(uint8_t digest[32]) {
+        uint64_t bits = length * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while (buffered != 56) update(&pad, 1);
+
+        uint8_t lengthBytes[8];
+        for (int k = 0; k < 8; ++k) lengthBytes[k] = uint8_t(bits >> (56 - 8 * k));
+        update(lengthBytes, 8);
+
+        for (int k = 0; k < 8; ++k) {
+            digest[4 * k] = uint8_t(state[k] >> 24);
+            digest[4 * k + 1] = uint8_t(state[k] >> 16);
+            digest[4 * k + 2] = uint8_t(state[k] >> 8);
+            digest[4 * k + 3] = uint8_t(state[k]);
+        }
+    }
+
+private:
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const uint8_t* chunk) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t(chunk[4 * i]) << 24) | (uint32_t(chunk[4 * i + 1]) << 16) |
+                (uint32_t(chunk[4 * i + 2]) << 8) | uint32_t(chunk[4 * i + 3]);
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[64];
+    size_t buffered;
+};
+
+class DropboxContentHasher {
+public:
+    void update(const char* data, size_t len) {
+        while (len > 0) {
+            size_t take = min(len, blockSize - inBlock);
+            blockHash.update(data, take);
+            inBlock += take;
+            data += take;
+            len -= take;
+
+            if (inBlock == blockSize) closeBlock();
+        }
+    }
+
+    string finish() {
+        if (inBlock > 0) closeBlock();
+
+        uint8_t digest[32];
+        overall.finish(digest);
+
+        static const char hexDigits[] = "0123456789abcdef";
+        string hex;
+        for (uint8_t byte : digest) {
+            hex += hexDigits[byte >> 4];
+            hex += hexDigits[byte & 0xf];
+        }
+        return hex;
+    }
+
+private:
+    static constexpr size_t blockSize = 4 * 1024 * 1024;
+
+    void closeBlock() {
+        uint8_t digest[32];
+        blockHash.finish(digest);
+        overall.update(digest, sizeof(digest));
+        blockHash.reset();
+        inBlock = 0;
+    }
+
+    Sha256 blockHash;
+    Sha256 overall;
+    size_t inBlock = 0;
+};
+
+string dropboxContentHash(string_view data) {
+    DropboxContentHasher hasher;
+    hasher.update(data.data(), data.size());
+    return hasher.finish();
+}
+
+// --- Upload sessions ---
+// Files above thresholdBytes go through upload_session/start, append_v2 and
+// finish in chunkBytes pieces instead of one files/upload (capped at 150 MB).
+// A failed chunk is resent from the last offset Dropbox acknowledged, taken
+// from an incorrect_offset error when the server reports one.
+
+struct UploadSessionOptions {
+    size_t thresholdBytes = 32 * 1024 * 1024;
+    size_t chunkBytes = 8 * 1024 * 1024;
+    int chunkRetries = 3;
+};
+
+struct UploadSession {
+    string sessionId;
+    size_t offset = 0;      // bytes Dropbox has acknowledged
+    size_t sending = 0;     // bytes in the request in flight
+    bool finishing = false;
+    int failures = 0;       // consecutive failures of the current chunk
+};
+
+enum class SessionStep { More, Done, Failed };
+
+unique_ptr<HttpRequest> makeUploadSessionRequest(
+    const string& accessToken,
+    string_view fileData,
+    const string& dropboxPath,
+    UploadSession& session,
+    const UploadSessionOptions& options)
+{
+    size_t remaining = fileData.size() - session.offset;
+    string url;
+    string apiArg;
+    JsonWriter json(apiArg, true);
+
+    session.finishing = false;
+    session.sending = min(remaining, options.chunkBytes);
+
+    if (session.sessionId.empty()) {
+        url = serviceUrls().dropboxContent + "/2/files/upload_session/start";
+        json.beginObject().key("close").boolean(false).endObject();
+    }
+    else {
+        json.beginObject().key("cursor").beginObject()
+            .key("session_id").value(session.sessionId)
+            .key("offset").number((long long)session.offset)
+            .endObject();
+
+        if (remaining <= options.chunkBytes) {
+            session.finishing = true;
+            url = serviceUrls().dropboxContent + "/2/files/upload_session/finish";
+            json.key("commit");
+            writeCommitInfo(json, dropboxPath);
+        }
+        else {
+            url = serviceUrls().dropboxContent + "/2/files/upload_session/append_v2";
+            json.key("close").boolean(false);
+        }
+        json.endObject();
+    }
+
+    auto req = makeDropboxContentRequest(accessToken, url, apiArg);
+    if (!req) return nullptr;
+
+    setPostBody(*req, fileData.substr(session.offset, session.sending));
+
+    return req;
+}
+
+SessionStep finishUploadSessionStep(
+    HttpRequest& req,
+    UploadSession& session,
+    const UploadSessionOptions& options,
+    string& responseOut)
+{
+    const string& response = req.response;
+
+    if (req.result == CURLE_OK && req.status == 200) {
+        session.failures = 0;
+
+        if (session.sessionId.empty()) {
+            session.sessionId = jsonString(jsonMember(response, "session_id"));
+            if (session.sessionId.empty()) return SessionStep::Failed;
+        }
+        else if (session.finishing) {
+            responseOut = response;
+            return SessionStep::Done;
+        }
+
+        session.offset += session.sending;
+        return SessionStep::More;
+    }
+
+    if (++session.failures > options.chunkRetries)
+        return SessionStep::Failed;
+
+    // Resume from wherever Dropbox says the session actually is; finish
+    // nests the offset error under lookup_failed
+    string_view correctOffset = jsonMember(response, { "error", "correct_offset" });
+    if (correctOffset.empty())
+        correctOffset = jsonMember(response, { "error", "lookup_failed", "correct_offset" });
+    if (!correctOffset.empty() && !session.sessionId.empty())
+        session.offset = size_t(jsonNumber(correctOffset, (long long)session.offset));
+
+    return SessionStep::More;
+}
+
+// --- Batched commits ---
+// --batch-commit: a file small enough for files/upload goes up with
+// upload_session/start (close=true) instead, several at once, and the
+// closed sessions are committed together by upload_session/finish_batch_v2.
+// Dropbox takes the namespace write lock once per commit, so single
+// uploads into one folder queue behind each other and come back with
+// too_many_write_operations; a batch takes it once for up to 1000 files.
+// Entries refused for that reason go into a later batch. One batch is out
+// at a time and the next goes as soon as it returns (group commit), so
+// batches grow by themselves while commits are slow.
+
+struct BatchCommitOptions {
+    bool enabled = false;
+    size_t maxEntries = 1000;   // the finish_batch_v2 limit
+    long lingerMs = 0;          // extra wait for more entries, once no batch is out
+    int entryRetries = 3;       // write conflicts one entry may hit
+};
+
+// A closed upload session waiting to be committed at path.
+struct SessionCommit {
+    string sessionId;
+    size_t bytes = 0;
+    string dropboxPath;
+};
+
+unique_ptr<HttpRequest> makeClosedSessionRequest(const string& accessToken, string_view fileData) {
+    string apiArg;
+    JsonWriter(apiArg, true).beginObject().key("close").boolean(true).endObject();
+
+    auto req = makeDropboxContentRequest(accessToken,
+        serviceUrls().dropboxContent + "/2/files/upload_session/start", apiArg);
+    if (!req) return nullptr;
+
+    setPostBody(*req, fileData);
+
+    return req;
+}
+
+// Session id from an upload_session/start answer; empty when it failed.
+string finishClosedSession(const HttpRequest& req) {
+    if (!httpOk(req)) return "";
+    return jsonString(jsonMember(req.response, "session_id"));
+}
+
+unique_ptr<HttpRequest> makeFinishBatchRequest(const string& accessToken, const vector<SessionCommit>& commits) {
+    auto req = make_unique<HttpRequest>(
+        serviceUrls().dropboxApi + "/2/files/upload_session/finish_batch_v2", "upload_commit");
+    if (!req->curl) return nullptr;
+
+    CURL* curl = req->curl;
+    struct curl_slist*& headers = req->headers;
+
+    addDropboxBusinessHeaders(headers, accessToken);
+    addDropboxNamespaceHeader(headers);
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+
+    JsonWriter json(req->body);
+    json.beginObject().key("entries").beginArray();
+    for (const SessionCommit& commit : commits) {
+        json.beginObject().key("cursor").beginObject()
+            .key("session_id").value(commit.sessionId)
+            .key("offset").number((long long)commit.bytes)
+            .endObject();
+        json.key("commit");
+        writeCommitInfo(json, commit.dropboxPath);
+        json.endObject();
+    }
+    json.endArray().endObject();
+
+    // Committed sessions are gone; only a refusal is safe to resend
+    req->retry = RetryPolicy::ThrottleOnly;
+
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req->body.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeToString);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+
+    return req;
+}
+
+// One finish_batch_v2 entry result: the file's metadata on success (the
+// fields are flattened into the entry), otherwise the failure's tag.
+bool readBatchEntry(string_view entry, string& metadata, string& reason) {
+    if (jsonString(jsonMember(entry, ".tag")) == "success") {
+        metadata = string(entry);
+        return true;
+    }
+    reason = jsonString(jsonMember(entry, { "failure", ".tag" }));
+    if (reason.empty()) reason = "unexpected answer";
+    return false;
+}
+
+// --- Streaming upload ---
+// The image download writes into a fixed-size ring buffer and the upload's
+// read callback drains it, so both transfers run at once and a row never
+// holds more than the ring's capacity. A full ring pauses the download, an
+// empty one pauses the upload; the other side asks the loop to resume it.
+
+class ByteRing {
+public:
+    explicit ByteRing(size_t capacity) : data(capacity) {}
+
+    size_t size() const { return used; }
+    size_t space() const { return data.size() - used; }
+
+    size_t write(const char* src, size_t len) {
+        len = min(len, space());
+        size_t tail = (head + used) % data.size();
+        size_t first = min(len, data.size() - tail);
+        memcpy(data.data() + tail, src, first);
+        memcpy(data.data(), src + first, len - first);
+        used += len;
+        return len;
+    }
+
+    size_t read(char* dst, size_t len) {
+        len = min(len, used);
+        size_t first = min(len, data.size() - head);
+        memcpy(dst, data.data() + head, first);
+        memcpy(dst + first, data.data(), len - first);
+        head = (head + len) % data.size();
+        used -= len;
+        return len;
+    }
+
+private:
+    vector<char> data;
+    size_t head = 0;
+    size_t used = 0;
+};
+
+struct StreamPipe {
+    explicit StreamPipe(TransferLoop& loop, size_t capacity) : loop(loop), ring(capacity) {}
+
+    TransferLoop& loop;
+    ByteRing ring;
+    CURL* download = nullptr;
+    CURL* upload = nullptr;
+    ImageCheck* image = nullptr;
+
+    // Upload not built yet: the download may still come back as a bodiless
+    // 304 or as something that is not an image, and the first bytes decide
+    // the file's extension. Released once the image check has decided.
+    function<void()> startUpload;
+
+    size_t bytesIn = 0;
+    DropboxContentHasher hasher;
+    bool downloadPaused = false;
+    bool uploadPaused = false;
+
+    bool downloadDone = false;
+    bool downloadOk = false;
+    bool downloadCutOff = false;    // aborted because the upload had already ended
+    bool uploadDone = false;
+    bool uploadOk = false;
+    bool uploadThrottled = false;   // refused for load; the row falls back to buffering
+    string uploadResponse;
+
+    void releaseUpload() {
+        if (!startUpload) return;
+        function<void()> start = move(startUpload);
+        startUpload = nullptr;
+        start();
+    }
+
+    void wakeDownload() {
+        if (downloadPaused && download) {
+            downloadPaused = false;
+            loop.resume(download);
+        }
+    }
+
+    void wakeUpload() {
+        if (uploadPaused && upload) {
+            uploadPaused = false;
+            loop.resume(upload);
+        }
+    }
+};
+
+size_t streamWriteCallback(void* contents, size_t size, size_t nmemb, void* userp)
+{
+    size_t total = size * nmemb;
+    StreamPipe* pipe = static_cast<StreamPipe*>(userp);
+
+    // Nobody left to send the bytes to
+    if (pipe->uploadDone) {
+        pipe->downloadCutOff = true;
+        return 0;
+    }
+
+    // An error page is not the image; stop before any of it reaches Dropbox
+    long status = 0;
+    curl_easy_getinfo(pipe->download, CURLINFO_RESPONSE_CODE, &status);
+    if (status >= 400)
+        return 0;
+
+    // libcurl hands the same chunk back on resume, so take it whole or not at all
+    if (pipe->ring.space() < total) {
+        pipe->downloadPaused = true;
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
+    // Same for anything that turns out not to be an image
+    if (!pipe->image->accept(static_cast<char*>(contents), total))
+        return 0;
+
+    pipe->ring.write(static_cast<char*>(contents), total);
+    pipe->hasher.update(static_cast<char*>(contents), total);
+    pipe->bytesIn += total;
+    if (pipe->image->decided())
+        pipe->releaseUpload();
+    pipe->wakeUpload();
+    return total;
+}
+
+size_t streamReadCallback(char* buffer, size_t size, size_t nitems, void* userp)
+{
+    StreamPipe* pipe = static_cast<StreamPipe*>(userp);
+
+    size_t n = pipe->ring.read(buffer, size * nitems);
+    if (n > 0) {
+        pipe->wakeDownload();
+        return n;
+    }
+
+    if (pipe->downloadDone) {
+        // A failed or empty download must not end up as a file in Dropbox
+        return pipe->downloadOk ? 0 : CURL_READFUNC_ABORT;
+    }
+
+    pipe->uploadPaused = true;
+    return CURL_READFUNC_PAUSE;
+}
+
+unique_ptr<HttpRequest> makeStreamingUploadRequest(
+    const string& accessToken,
+    const string& dropboxPath,
+    StreamPipe& pipe)
+{
+    auto req = makeDropboxUploadRequest(accessToken, dropboxPath);
+    if (!req) return nullptr;
+
+    // Size is unknown until the download ends
+    req->headers = curl_slist_append(req->headers, "Transfer-Encoding: chunked");
+    curl_easy_setopt(req->curl, CURLOPT_READFUNCTION, streamReadCallback);
+    curl_easy_setopt(req->curl, CURLOPT_READDATA, &pipe);
+
+    return req;
+}
+
+bool finishUploadToDropbox(HttpRequest& req, string& responseOut)
+{
+    responseOut = move(req.response);
+    return httpOk(req);
+}
+
+unique_ptr<HttpRequest> makeCreateShareLinkRequest(
+    const string& accessToken,
+    const string& dropboxPath,
+    ostream& log = cerr)
+{
+    log << "[createDropboxShareLink] ENTER, path=" << dropboxPath << endl;
+
+    auto req = make_unique<HttpRequest>(
+        serviceUrls().dropboxApi + "/2/sharing/create_shared_link_with_settings", "link_create");
+    if (!req->curl) {
+        log << "[createDropboxShareLink] CURL init failed\n";
+        return nullptr;
+    }
+
+    CURL* curl = req->curl;
+    struct curl_slist*& headers = req->headers;
+
+    addDropboxBusinessHeaders(headers, accessToken);
+    addDropboxNamespaceHeader(headers);
+
+    headers = curl_slist_append(headers,
+        "Content-Type: application/json");
+
+    JsonWriter(req->body).beginObject()
+        .key("path").value(dropboxPath)
+        .key("settings").beginObject().key("requested_visibility").value("public").endObject()
+        .endObject();
+
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req->body.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeBinaryCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+
+    return req;
+}
+
+bool finishCreateDropboxShareLink(
+    HttpRequest& req,
+    string& outLink,
+    ostream& log = cerr)
+{
+    const string& response = req.response;
+
+    if (!httpOk(req))
+        return false;
+
+    string url = jsonString(jsonMember(response, "url"));
+    if (url.empty()) {
+        log << "[createDropboxShareLink] URL not found in response\n";
+        return false;
+    }
+
+    size_t dlPos = url.find("?dl=0");
+    if (dlPos != string::npos)
+        url.replace(dlPos, 5, "?dl=1");
+
+    outLink = url;
+    return true;
+}
+
+size_t WriteCallback(void* contents, size_t size, size_t nmemb, void* userp) {
+    ((string*)userp)->append((char*)contents, size * nmemb);
+    return size * nmemb;
+}
+
+unique_ptr<HttpRequest> makeExistingSharedLinkRequest(const string& accessToken, const string& dropboxPath) {
+    auto req = make_unique<HttpRequest>(serviceUrls().dropboxApi + "/2/sharing/list_shared_links", "link_lookup");
+    if (!req->curl) return nullptr;
+
+    CURL* curl = req->curl;
+    struct curl_slist*& headers = req->headers;
+
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+
+    JsonWriter(req->body).beginObject()
+        .key("path").value(dropboxPath)
+        .key("direct_only").boolean(true)
+        .endObject();
+
+    addDropboxBusinessHeaders(headers, accessToken);
+    addDropboxNamespaceHeader(headers);
+
+    headers = curl_slist_append(headers,
+        "Content-Type: application/json");
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req->body.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+
+    return req;
+}
+
+// create_shared_link_with_settings answers 409 shared_link_already_exists for a
+// path that already has a link; the error metadata usually carries that link.
+// existingLink is left empty when it does not, and list_shared_links has to
+// be asked instead.
+bool sharedLinkAlreadyExists(const HttpRequest& req, string& existingLink) {
+    if (req.result != CURLE_OK || req.status != 409)
+        return false;
+
+    string_view error = jsonMember(req.response, "error");
+    if (jsonString(jsonMember(error, ".tag")) != "shared_link_already_exists")
+        return false;
+
+    existingLink = jsonString(jsonMember(error, { "shared_link_already_exists", "metadata", "url" }));
+    return true;
+}
+
+string finishGetExistingSharedLink(HttpRequest& req, ostream& log = cerr) {
+    if (!httpOk(req)) {
+        log << "Error fetching existing shared link: " << httpError(req) << endl;
+        return "";
+    }
+
+    string_view link;
+    JsonElements links(jsonMember(req.response, "links"));
+    if (!links.next(link))
+        return "";
+
+    return jsonString(jsonMember(link, "url"));
+}
+
+string extractPathLower(const string& response) {
+    return jsonString(jsonMember(response, "path_lower"));
+}
+
+unique_ptr<HttpRequest> makeDropboxTokenRequest() {
+    auto req = make_unique<HttpRequest>(serviceUrls().dropboxApi + "/oauth2/token", "token");
+    CURL* curl = req->curl;
+    if (!curl) return nullptr;
+
+    req->body =
+        "grant_type=refresh_token&refresh_token=" + urlEncode(DROPBOX_REFRESH_TOKEN) +
+        "&client_id=" + urlEncode(DROPBOX_APP_KEY) +
+        "&client_secret=" + urlEncode(DROPBOX_APP_SECRET);
+
+    req->headers = curl_slist_append(req->headers, "Content-Type: application/x-www-form-urlencoded");
+
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req->body.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeToString);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+
+    return req;
+}
+
+unique_ptr<HttpRequest> makeGoogleTokenRequest() {
+    auto req = make_unique<HttpRequest>(serviceUrls().googleOAuth + "/token", "token");
+    CURL* curl = req->curl;
+    if (!curl) return nullptr;
+
+    req->body =
+        "client_id=" + urlEncode(GOOGLE_CLIENT_ID) +
+        "&client_secret=" + urlEncode(GOOGLE_CLIENT_SECRET) +
+        "&refresh_token=" + urlEncode(GOOGLE_REFRESH_TOKEN) +
+        "&grant_type=refresh_token";
+
+    req->headers = curl_slist_append(req->headers, "Content-Type: application/x-www-form-urlencoded");
+
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req->body.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeToString);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+
+    return req;
+}
+
+// Both OAuth endpoints answer with access_token and expires_in (seconds).
+bool finishAccessTokenRequest(HttpRequest& req, string& token, long& expiresIn) {
+    if (!httpOk(req)) {
+        cerr << "[ERROR] Curl failed: " << httpError(req) << endl;
+        return false;
+    }
+
+    const string& response = req.response;
+
+    token = jsonString(jsonMember(response, "access_token"));
+    if (token.empty()) {
+        cerr << "[ERROR] access_token not found in response" << endl;
+        return false;
+    }
+
+    expiresIn = long(jsonNumber(jsonMember(response, "expires_in")));
+    return true;
+}
+
+bool dropboxLinkMatchesFilename(const string& dropboxLink, const string& fileName) {
+    if (dropboxLink.empty() || fileName.empty())
+        return false;
+
+    return dropboxLink.find(fileName) != string::npos;
+}
+
+unique_ptr<HttpRequest> makeTeamMembersRequest(const string& accessToken) {
+    auto req = make_unique<HttpRequest>(serviceUrls().dropboxApi + "/2/team/members/list", "team");
+    CURL* curl = req->curl;
+    if (!curl) return nullptr;
+
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+
+    req->headers = curl_slist_append(req->headers, ("Authorization: Bearer " + accessToken).c_str());
+    req->headers = curl_slist_append(req->headers, "Content-Type: application/json");
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
+
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, "{}"); // empty body
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeToString);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+
+    return req;
+}
+
+vector<string> finishListTeamMemberIds(HttpRequest& req) {
+    vector<string> ids;
+
+    if (!httpOk(req)) {
+        cerr << "Failed to list team members: " << httpError(req) << endl;
+        return ids;
+    }
+
+    string_view member;
+    JsonElements members(jsonMember(req.response, "members"));
+    while (members.next(member)) {
+        string id = jsonString(jsonMember(member, { "profile", "team_member_id" }));
+        if (!id.empty()) ids.push_back(move(id));
+    }
+
+    return ids;
+}
+
+
+// One page of every shared link visible to the account; list_shared_links
+// without a path, continued with the page's cursor.
+unique_ptr<HttpRequest> makeListSharedLinksRequest(const string& accessToken, const string& cursor) {
+    auto req = make_unique<HttpRequest>(serviceUrls().dropboxApi + "/2/sharing/list_shared_links", "link_sweep");
+    CURL* curl = req->curl;
+    if (!curl) return nullptr;
+
+    addDropboxBusinessHeaders(req->headers, accessToken);
+    addDropboxNamespaceHeader(req->headers);
+    req->headers = curl_slist_append(req->headers, "Content-Type: application/json");
+
+    JsonWriter json(req->body);
+    json.beginObject();
+    if (!cursor.empty()) json.key("cursor").value(cursor);
+    json.endObject();
+
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req->body.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeToString);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+
+    return req;
+}
+
+// Adds the page's links under any of foldersLower as path_lower -> url.
+// Returns true with cursor set when there are more pages.
+bool readSharedLinksPage(
+    HttpRequest& req,
+    const vector<string>& foldersLower,
+    unordered_map<string, string>& links,
+    string& cursor)
+{
+    if (!httpOk(req)) {
+        cerr << "Failed to list shared links: " << httpError(req) << endl;
+        return false;
+    }
+
+    string_view link;
+    JsonElements page(jsonMember(req.response, "links"));
+    while (page.next(link)) {
+        string pathLower = jsonString(jsonMember(link, "path_lower"));
+        bool wanted = any_of(foldersLower.begin(), foldersLower.end(),
+            [&](const string& folder) { return pathLower.rfind(folder, 0) == 0; });
+        if (wanted)
+            links.emplace(pathLower, jsonString(jsonMember(link, "url")));
+    }
+
+    if (jsonMember(req.response, "has_more") != "true")
+        return false;
+    cursor = jsonString(jsonMember(req.response, "cursor"));
+    return !cursor.empty();
+}
+
+// --- Server-side fetch ---
+// --save-url: Dropbox fetches a public image itself with files/save_url, so
+// its bytes never cross this machine. The call answers with an async job id,
+// and every outstanding job is polled with save_url/check_job_status in one
+// round; the rounds come closer while jobs are finishing and back off while
+// they are not. Rows whose bytes must be seen here (no extension in the file
+// name, a URL Dropbox cannot reach) and jobs Dropbox fails go the usual
+// download and upload way. Nothing is sniffed on this path: the file is
+// whatever the URL served.
+
+struct SaveUrlOptions {
+    bool enabled = false;
+    long minPollMs = 500;
+    long maxPollMs = 8000;
+};
+
+// A strict dotted quad ("192.0.2.1"): four decimal octets, no leading zeros.
+bool parseDottedQuad(string_view host, uint32_t& address) {
+    address = 0;
+    for (int part = 0; part < 4; ++part) {
+        size_t dot = part < 3 ? host.find('.') : host.size();
+        if (dot == string_view::npos) return false;
+        string_view octet = host.substr(0, dot);
+        unsigned value = 0;
+        auto [next, ec] = from_chars(octet.data(), octet.data() + octet.size(), value);
+        if (ec != errc() || next != octet.data() + octet.size() || value > 255 ||
+            (octet.size() > 1 && octet[0] == '0'))
+            return false;
+        address = (address << 8) | value;
+        host.remove_prefix(min(host.size(), dot + 1));
+    }
+    return true;
+}
+
+// Outside every IPv4 special-purpose block (RFC 6890): this network,
+// private, shared (CGNAT), loopback, link-local, protocol assignments,
+// documentation, 6to4 relay, benchmarking, multicast and reserved.
+bool globalIpv4(uint32_t address) {
+    static const struct { uint32_t base; int bits; } special[] = {
+        { 0x00000000, 8 }, { 0x0A000000, 8 }, { 0x64400000, 10 }, { 0x7F000000, 8 },
+        { 0xA9FE0000, 16 }, { 0xAC100000, 12 }, { 0xC0000000, 24 }, { 0xC0000200, 24 },
+        { 0xC0586300, 24 }, { 0xC0A80000, 16 }, { 0xC6120000, 15 }, { 0xC6336400, 24 },
+        { 0xCB007100, 24 }, { 0xE0000000, 3 } };
+    for (auto& block : special) {
+        if ((address >> (32 - block.bits)) == (block.base >> (32 - block.bits)))
+            return false;
+    }
+    return true;
+}
+
+// http(s), no credentials in the URL, and a host the internet can reach: a
+// name with a dot outside .localhost/.local, or a global IPv4 address. IPv6
+// literals are refused outright, and so are numeric hosts that are not a
+// strict dotted quad (127.1, 0x7f.0.0.1, 010.0.0.1), which resolvers still
+// read as addresses.
+bool publicUrl(const string& url) {
+    size_t start = url.find("://");
+    if (start == string::npos) return false;
+    string scheme = lowercase(url.substr(0, start));
+    if (scheme != "http" && scheme != "https") return false;
+
+    start += 3;
+    size_t end = url.find_first_of("/?#", start);
+    string authority = lowercase(url.substr(start, end == string::npos ? string::npos : end - start));
+    if (authority.find('@') != string::npos || authority.empty() || authority[0] == '[')
+        return false;
+
+    string host = authority.substr(0, authority.find(':'));
+    if (host.ends_with("."))
+        host.pop_back();
+    if (host.find('.') == string::npos || host == "localhost" || host.ends_with(".localhost") || host.ends_with(".local"))
+        return false;
+
+    // No top-level domain starts with a digit, so such a host is an address
+    char tld = host[host.rfind('.') + 1];
+    if (tld < '0' || tld > '9')
+        return true;
+
+    uint32_t address;
+    return parseDottedQuad(host, address) && globalIpv4(address);
+}
+
+unique_ptr<HttpRequest> makeSaveUrlRequest(
+    const string& accessToken,
+    const string& url,
+    const string& dropboxPath)
+{
+    auto req = make_unique<HttpRequest>(serviceUrls().dropboxApi + "/2/files/save_url", "save_url");
+    if (!req->curl) return nullptr;
+
+    CURL* curl = req->curl;
+    struct curl_slist*& headers = req->headers;
+
+    addDropboxBusinessHeaders(headers, accessToken);
+    addDropboxNamespaceHeader(headers);
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+
+    JsonWriter(req->body).beginObject()
+        .key("path").value(dropboxPath)
+        .key("url").value(url)
+        .endObject();
+
+    // A resent call after a 5xx could start a second job for the same path
+    req->retry = RetryPolicy::ThrottleOnly;
+
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req->body.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeToString);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+
+    return req;
+}
+
+unique_ptr<HttpRequest> makeCheckSaveUrlRequest(const string& accessToken, const string& asyncJobId) {
+    auto req = make_unique<HttpRequest>(serviceUrls().dropboxApi + "/2/files/save_url/check_job_status", "save_url_check");
+    if (!req->curl) return nullptr;
+
+    CURL* curl = req->curl;
+    struct curl_slist*& headers = req->headers;
+
+    addDropboxBusinessHeaders(headers, accessToken);
+    addDropboxNamespaceHeader(headers);
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+
+    JsonWriter(req->body).beginObject().key("async_job_id").value(asyncJobId).endObject();
+
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req->body.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeToString);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+
+    return req;
+}
+
+enum class SaveUrlState { Pending, Done, Failed };
+
+// Reads a save_url or check_job_status answer. Pending sets jobId when the
+// answer carries one, Done leaves the file's metadata in metadata (the
+// fields are flattened into the answer), Failed says why in reason. A
+// check on a known job that did not get through (transport error, 429 or
+// 5xx after the retries) says nothing about the job, which stays Pending.
+SaveUrlState readSaveUrlStatus(HttpRequest& req, string& jobId, string& metadata, string& reason) {
+    if (!httpOk(req)) {
+        if (!jobId.empty() && (req.status == 0 || req.status == 429 || req.status >= 500))
+            return SaveUrlState::Pending;
+        reason = req.status >= 400 ? jsonString(jsonMember(req.response, "error_summary")) : "";
+        if (reason.empty()) reason = httpError(req);
+        return SaveUrlState::Failed;
+    }
+
+    string tag = jsonString(jsonMember(req.response, ".tag"));
+    if (tag == "async_job_id") {
+        jobId = jsonString(jsonMember(req.response, "async_job_id"));
+        return jobId.empty() ? SaveUrlState::Failed : SaveUrlState::Pending;
+    }
+    if (tag == "in_progress")
+        return SaveUrlState::Pending;
+    if (tag == "complete") {
+        metadata = move(req.response);
+        return SaveUrlState::Done;
+    }
+
+    reason = jsonString(jsonMember(req.response, { "failed", ".tag" }));
+    if (reason.empty()) reason = "unexpected answer: " + req.response;
+    return SaveUrlState::Failed;
+}
+
+// --- Folder index ---
+// Files already in the target folder, from one list_folder sweep at startup,
+// so rows whose file is there are not downloaded or uploaded again.
+
+struct FolderFile {
+    string pathLower;
+    uint64_t size = 0;
+    string contentHash;
+};
+
+struct FolderIndex {
+    unordered_map<string, FolderFile> byName;       // lowercased file name
+
+    const FolderFile* findByName(const string& nameLower) const {
+        auto found = byName.find(nameLower);
+        return found == byName.end() ? nullptr : &found->second;
+    }
+};
+
+unique_ptr<HttpRequest> makeListFolderRequest(
+    const string& accessToken,
+    const string& folder,
+    const string& cursor)
+{
+    auto req = make_unique<HttpRequest>(cursor.empty()
+        ? serviceUrls().dropboxApi + "/2/files/list_folder"
+        : serviceUrls().dropboxApi + "/2/files/list_folder/continue", "folder_sweep");
+    CURL* curl = req->curl;
+    if (!curl) return nullptr;
+
+    addDropboxBusinessHeaders(req->headers, accessToken);
+    addDropboxNamespaceHeader(req->headers);
+    req->headers = curl_slist_append(req->headers, "Content-Type: application/json");
+
+    // list_folder wants the root as "" and no trailing slash elsewhere
+    string path = folder;
+    while (!path.empty() && path.back() == '/') path.pop_back();
+
+    JsonWriter json(req->body);
+    json.beginObject();
+    if (cursor.empty())
+        json.key("path").value(path).key("recursive").boolean(false).key("limit").number(2000);
+    else
+        json.key("cursor").value(cursor);
+    json.endObject();
+
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req->body.c_str());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeToString);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+
+    return req;
+}
+
+// Adds the page's files to index. Returns true with cursor set when there
+// are more pages.
+bool readFolderPage(HttpRequest& req, FolderIndex& index, string& cursor) {
+    if (!httpOk(req)) {
+        cerr << "Failed to list Dropbox folder: " << httpError(req) << endl;
+        return false;
+    }
+
+    string_view entry;
+    JsonElements entries(jsonMember(req.response, "entries"));
+    while (entries.next(entry)) {
+        if (jsonString(jsonMember(entry, ".tag")) != "file") continue;
+
+        FolderFile& file = index.byName[lowercase(jsonString(jsonMember(entry, "name")))];
+        file.pathLower = jsonString(jsonMember(entry, "path_lower"));
+        file.size = uint64_t(jsonNumber(jsonMember(entry, "size")));
+        file.contentHash = jsonString(jsonMember(entry, "content_hash"));
+    }
+
+    if (jsonMember(req.response, "has_more") != "true")
+        return false;
+    cursor = jsonString(jsonMember(req.response, "cursor"));
+    return !cursor.empty();
+}
+
+unique_ptr<HttpRequest> makeSheetBatchUpdateRequest(
+    string jsonPayload,
+    const string& sheetId,
+    const string& accessToken)
+{
+    string url = serviceUrls().sheets + "/v4/spreadsheets/" + urlEncode(sheetId)
+        + "/values:batchUpdate";
+
+    auto req = make_unique<HttpRequest>(url, "sheets");
+    if (!req->curl) return nullptr;
+
+    CURL* curl = req->curl;
+    struct curl_slist*& headers = req->headers;
+
+    req->body = move(jsonPayload);
+
+    headers = curl_slist_append(headers, ("Authorization: Bearer " + accessToken).c_str());
+    headers = curl_slist_append(headers, "Content-Type: application/json");
+
+    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, req->body.c_str());
+
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeToString);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+
+    return req;
+}
+
+bool finishSheetBatchUpdate(HttpRequest& req, ostream& log = cerr) {
+    if (!httpOk(req)) {
+        log << "[ERROR] Sheet update failed: " << httpError(req) << endl;
+        return false;
+    }
+    return true;
+}
+
+// --- Sheet writes ---
+// Finished links are buffered and written with values:batchUpdate instead of
+// one PUT per row. Adjacent rows in a column go out as one range. A batch is
+// sent once it holds batchCells cells or its oldest cell has waited
+// flushIntervalMs; flush() sends whatever is left.
+
+struct SheetWriteOptions {
+    size_t batchCells = 500;
+    long flushIntervalMs = 2000;
+};
+
+class SheetWriter {
+public:
+    SheetWriter(
+        TransferLoop& loop,
+        const SheetWriteOptions& options,
+        size_t maxInFlight,
+        const string& accessToken,
+        const string& sheetId,
+        const string& tab)
+        : loop(loop), options(options), maxInFlight(maxInFlight), accessToken(accessToken),
+          sheetId(sheetId), tabPrefix(tabReference(tab) + "!") {}
+
+    // Called per row once its cells are in the sheet (or failed to get there).
+    function<void(int row, bool ok)> onWritten;
+
+    // Cells that already hold value are not written again.
+    void queue(int row, int col, const string& value, const string& currentValue) {
+        if (value == currentValue) {
+            if (onWritten) onWritten(row, true);
+            return;
+        }
+
+        auto now = chrono::steady_clock::now();
+        if (pending.empty())
+            oldestPending = now;
+
+        // A rewritten cell keeps its place in line
+        auto [cell, added] = pending.try_emplace({ col, row }, PendingCell{ value, now });
+        if (!added) cell->second.value = value;
+    }
+
+    // Sends a batch if the size or time threshold has been reached.
+    void tick() {
+        while (!pending.empty() && inFlight < maxInFlight) {
+            auto waited = chrono::duration_cast<chrono::milliseconds>(
+                chrono::steady_clock::now() - oldestPending).count();
+            if (pending.size() < options.batchCells && waited < options.flushIntervalMs)
+                break;
+            sendBatch();
+        }
+    }
+
+    // Sends everything pending, as far as the in-flight limit allows.
+    void flush() {
+        while (!pending.empty() && inFlight < maxInFlight)
+            sendBatch();
+    }
+
+    bool idle() const { return pending.empty() && inFlight == 0; }
+
+private:
+    using CellKey = pair<int, int>;     // (col, row), ordered for range coalescing
+
+    string rangeFor(int col, int firstRow, int lastRow) const {
+        string range = tabPrefix + "R" + to_string(firstRow) + "C" + to_string(col);
+        if (lastRow != firstRow)
+            range += ":R" + to_string(lastRow) + "C" + to_string(col);
+        return range;
+    }
+
+    void sendBatch() {
+        vector<int> rows;
+        string jsonPayload;
+        JsonWriter json(jsonPayload);
+        json.beginObject().key("valueInputOption").value("RAW").key("data").beginArray();
+
+        // A range is only known once its last cell is, so each run of rows
+        // is found first and then written out
+        auto it = pending.begin();
+        for (size_t n = 0; it != pending.end() && n < options.batchCells;) {
+            int col = it->first.first;
+            int firstRow = it->first.second;
+            auto last = it;
+            size_t cells = 1;
+            for (auto next = std::next(it); next != pending.end() && n + cells < options.batchCells &&
+                next->first.first == col && next->first.second == last->first.second + 1; ++next)
+            {
+                last = next;
+                ++cells;
+            }
+
+            json.beginObject()
+                .key("range").value(rangeFor(col, firstRow, last->first.second))
+                .key("majorDimension").value("ROWS")
+                .key("values").beginArray();
+            for (size_t k = 0; k < cells; ++k, ++it) {
+                json.beginArray().value(it->second.value).endArray();
+                rows.push_back(it->first.second);
+            }
+            json.endArray().endObject();
+            n += cells;
+        }
+        json.endArray().endObject();
+
+        pending.erase(pending.begin(), it);
+        // Batches go in cell order, so what is left may be older than what went
+        if (!pending.empty()) {
+            oldestPending = pending.begin()->second.queued;
+            for (const auto& entry : pending)
+                oldestPending = min(oldestPending, entry.second.queued);
+        }
+
+        unique_ptr<HttpRequest> req = makeSheetBatchUpdateRequest(move(jsonPayload), sheetId, accessToken);
+        if (!req) {
+            reportFailure(rows);
+            return;
+        }
+
+        ++inFlight;
+        req->onDone = [this, rows](HttpRequest& done) {
+            --inFlight;
+            if (!finishSheetBatchUpdate(done)) {
+                reportFailure(rows);
+                return;
+            }
+            if (onWritten) {
+                for (int row : rows) onWritten(row, true);
+            }
+        };
+        loop.add(move(req));
+    }
+
+    void reportFailure(const vector<int>& rows) {
+        for (int row : rows) {
+            cerr << "Failed to update Google Sheet for row " << row << endl;
+            if (onWritten) onWritten(row, false);
+        }
+    }
+
+    TransferLoop& loop;
+    SheetWriteOptions options;
+    size_t maxInFlight;
+    const string& accessToken;
+    string sheetId;
+    string tabPrefix;               // "Images!" or "'My tab'!"
+
+    struct PendingCell {
+        string value;
+        chrono::steady_clock::time_point queued;
+    };
+
+    map<CellKey, PendingCell> pending;
+    chrono::steady_clock::time_point oldestPending;     // of the cells in pending
+    size_t inFlight = 0;
+};
+
+// --- Upload cache ---
+// On-disk map from content hash to the Dropbox path and shared link of a file
+// we already uploaded, plus source URL -> content hash and the URL's HTTP
+// validators (ETag / Last-Modified) for conditional downloads. The file is an
+// append-only list of length-prefixed key/value records; it is mmap'ed at
+// startup and indexed in place, and new records are appended as rows finish.
+// Later records win; the file is compacted on close once mostly stale.
+
+class UploadCache {
+public:
+    struct Entry {
+        string pathLower;
+        string link;
+    };
+
+    ~UploadCache() { close(); }
+
+    bool open(const string& cachePath) {
+        path = cachePath;
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            mapSize = size_t(st.st_size);
+            fileSize = mapSize;
+            void* mapping = mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                mapSize = 0;
+            }
+            else {
+                mapped = static_cast<const char*>(mapping);
+                indexMapped();
+            }
+        }
+
+        // A torn record from a crash would hide everything appended after it
+        if (fileSize < mapSize && ftruncate(fd, off_t(fileSize)) != 0)
+            fileSize = mapSize;
+        return true;
+    }
+
+    bool findByHash(const string& hash, Entry& out) const {
+        string_view value;
+        if (!lookup("h:" + hash, value)) return false;
+
+        size_t split = value.find('\n');
+        if (split == string_view::npos) return false;
+
+        out.pathLower = string(value.substr(0, split));
+        out.link = string(value.substr(split + 1));
+        return true;
+    }
+
+    bool findHashForUrl(const string& url, string& hash) const {
+        string_view value;
+        if (!lookup("u:" + url, value)) return false;
+        hash = string(value);
+        return true;
+    }
+
+    bool findValidators(const string& url, DownloadValidators& out) const {
+        string_view value;
+        if (!lookup("v:" + url, value)) return false;
+
+        size_t split = value.find('\n');
+        if (split == string_view::npos) return false;
+
+        out.etag = string(value.substr(0, split));
+        out.lastModified = string(value.substr(split + 1));
+        return true;
+    }
+
+    void putValidators(const string& url, const DownloadValidators& validators) {
+        if (fd < 0) return;
+        append("v:" + url, validators.etag + "\n" + validators.lastModified);
+    }
+
+    void put(const string& url, const string& hash, const Entry& entry) {
+        if (fd < 0) return;
+
+        if (!url.empty()) append("u:" + url, hash);
+        append("h:" + hash, entry.pathLower + "\n" + entry.link);
+    }
+
+    void close() {
+        if (fd < 0) return;
+
+        bool compact = records > 64 && records > 2 * liveCount();
+        if (compact) rewrite();
+
+        if (mapped) munmap(const_cast<char*>(mapped), mapSize);
+        mapped = nullptr;
+        mapSize = 0;
+        ::close(fd);
+        fd = -1;
+    }
+
+private:
+    bool lookup(const string& key, string_view& value) const {
+        auto added = appended.find(key);
+        if (added != appended.end()) {
+            value = added->second;
+            return true;
+        }
+
+        auto found = index.find(key);
+        if (found == index.end()) return false;
+        value = found->second;
+        return true;
+    }
+
+    size_t liveCount() const {
+        size_t live = index.size();
+        for (auto& entry : appended) {
+            if (!index.count(entry.first)) ++live;
+        }
+        return live;
+    }
+
+    void indexMapped() {
+        size_t pos = 0;
+        while (pos + 8 <= mapSize) {
+            uint32_t keyLen, valueLen;
+            memcpy(&keyLen, mapped + pos, 4);
+            memcpy(&valueLen, mapped + pos + 4, 4);
+            if (pos + 8 + size_t(keyLen) + valueLen > mapSize) break;  // torn tail
+
+            string_view key(mapped + pos + 8, keyLen);
+            string_view value(mapped + pos + 8 + keyLen, valueLen);
+            index[key] = value;
+            ++records;
+            pos += 8 + size_t(keyLen) + valueLen;
+        }
+        fileSize = pos;
+    }
+
+    static string encode(const string& key, const string& value) {
+        uint32_t keyLen = uint32_t(key.size());
+        uint32_t valueLen = uint32_t(value.size());
+
+        string record(8, '\0');
+        memcpy(&record[0], &keyLen, 4);
+        memcpy(&record[4], &valueLen, 4);
+        record += key;
+        record += value;
+        return record;
+    }
+
+    void append(const string& key, const string& value) {
+        string record = encode(key, value);
+        ssize_t written = ::write(fd, record.data(), record.size());
+        if (written != ssize_t(record.size())) {
+            // Cut a partial record off again so later ones stay readable
+            if (written > 0 && ftruncate(fd, off_t(fileSize)) != 0)
+                cerr << "Upload cache may be damaged: " << path << endl;
+            return;
+        }
+
+        fileSize += record.size();
+        appended[key] = value;
+        ++records;
+    }
+
+    void rewrite() {
+        string tmpPath = path + ".tmp";
+        int out = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) return;
+
+        string data;
+        for (auto& entry : index) {
+            if (!appended.count(string(entry.first)))
+                data += encode(string(entry.first), string(entry.second));
+        }
+        for (auto& entry : appended)
+            data += encode(entry.first, entry.second);
+
+        bool ok = ::write(out, data.data(), data.size()) == ssize_t(data.size()) &&
+            fsync(out) == 0;
+        ::close(out);
+
+        if (ok) rename(tmpPath.c_str(), path.c_str());
+        else unlink(tmpPath.c_str());
+    }
+
+    string path;
+    int fd = -1;
+    const char* mapped = nullptr;
+    size_t mapSize = 0;
+    size_t fileSize = 0;            // end of the last whole record
+    size_t records = 0;
+
+    unordered_map<string_view, string_view> index;  // views into the mapping
+    unordered_map<string, string> appended;         // written this run
+};
+
+// --- Run journal ---
+// Crash-safe progress log. Each line records a stage a row got through:
+// D (downloaded, content hash), U (uploaded, Dropbox path), L (linked, shared
+// link), W (sheet cell written) or S (settled in an earlier run). Rows are
+// keyed by index plus a hash of their cells, so an edited row starts over.
+// Lines are buffered and written with one fsync per batch; a torn last line is
+// ignored on load. After a run the file is rewritten as S lines only - that is
+// the snapshot the next CSV is diffed against.
+
+struct JournalOptions {
+    bool enabled = true;                // --no-journal turns it off
+    string path = ".uploader-journal";
+    size_t batchRecords = 64;           // fsync after this many lines...
+    long syncIntervalMs = 500;          // ...or once the oldest has waited this long
+};
+
+class RunJournal {
+public:
+    enum Mark : char {
+        Downloaded = 'D',
+        Uploaded = 'U',
+        Linked = 'L',
+        Written = 'W',
+        Settled = 'S'
+    };
+
+    struct RowState {
+        Mark mark = Downloaded;
+        string value;
+    };
+
+    ~RunJournal() {
+        sync();
+        if (fd >= 0) ::close(fd);
+    }
+
+    bool open(const JournalOptions& journalOptions) {
+        options = journalOptions;
+        fd = ::open(options.path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) return false;
+
+        string data;
+        char chunk[64 * 1024];
+        ssize_t n;
+        while ((n = ::read(fd, chunk, sizeof(chunk))) > 0)
+            data.append(chunk, size_t(n));
+
+        size_t pos = 0;
+        for (;;) {
+            size_t end = data.find('\n', pos);
+            if (end == string::npos) break;     // torn tail
+            load(string_view(data).substr(pos, end - pos));
+            pos = end + 1;
+        }
+
+        return true;
+    }
+
+    // Furthest stage an earlier run got to for this row and content.
+    const RowState* find(size_t row, uint64_t hash) const {
+        auto found = previous.find({ row, hash });
+        return found == previous.end() ? nullptr : &found->second;
+    }
+
+    void record(Mark mark, size_t row, uint64_t hash, const string& value = "") {
+        if (fd < 0) return;
+
+        if (mark == Written || mark == Settled)
+            settled.insert({ row, hash });
+
+        if (buffered == 0)
+            oldestBuffered = chrono::steady_clock::now();
+
+        ostringstream line;
+        line << char(mark) << '\t' << row << '\t' << hex << hash << '\t' << value << '\n';
+        buffer += line.str();
+        ++buffered;
+
+        if (buffered >= options.batchRecords)
+            sync();
+    }
+
+    // Carries a row settled in an earlier run into the next snapshot.
+    void keep(size_t row, uint64_t hash) {
+        if (fd >= 0) settled.insert({ row, hash });
+    }
+
+    // Syncs a batch whose oldest line has waited long enough.
+    void tick() {
+        if (buffered == 0) return;
+
+        auto waited = chrono::duration_cast<chrono::milliseconds>(
+            chrono::steady_clock::now() - oldestBuffered).count();
+        if (waited >= options.syncIntervalMs)
+            sync();
+    }
+
+    void sync() {
+        if (fd < 0 || buffered == 0) return;
+
+        if (::write(fd, buffer.data(), buffer.size()) == ssize_t(buffer.size()))
+            fdatasync(fd);
+
+        buffer.clear();
+        buffered = 0;
+    }
+
+    // Rewrites the journal as the snapshot of settled rows. Rows that failed
+    // this run are left out and get scheduled again next time.
+    void compact() {
+        if (fd < 0) return;
+        sync();
+
+        string tmpPath = options.path + ".tmp";
+        int out = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0) return;
+
+        ostringstream data;
+        for (auto& key : settled)
+            data << char(Settled) << '\t' << key.first << '\t' << hex << key.second << dec << "\t\n";
+
+        string snapshot = data.str();
+        bool ok = ::write(out, snapshot.data(), snapshot.size()) == ssize_t(snapshot.size()) &&
+            fsync(out) == 0;
+        ::close(out);
+
+        if (ok) rename(tmpPath.c_str(), options.path.c_str());
+        else unlink(tmpPath.c_str());
+    }
+
+    // Hash of the cells that decide what a row does.
+    static uint64_t rowHash(initializer_list<string_view> cells) { return fnv1a(cells); }
+
+private:
+    using RowKey = pair<size_t, uint64_t>;
+
+    static int rank(Mark mark) {
+        switch (mark) {
+        case Downloaded: return 1;
+        case Uploaded: return 2;
+        case Linked: return 3;
+        default: return 4;      // Written, Settled
+        }
+    }
+
+    void load(string_view line) {
+        // M \t row \t hash \t value
+        size_t a = line.find('\t');
+        size_t b = a == string_view::npos ? a : line.find('\t', a + 1);
+        size_t c = b == string_view::npos ? b : line.find('\t', b + 1);
+        if (a != 1 || c == string_view::npos) return;
+
+        Mark mark = Mark(line[0]);
+        if (string_view("DULWS").find(line[0]) == string_view::npos) return;
+
+        string rowText(line.substr(a + 1, b - a - 1));
+        string hashText(line.substr(b + 1, c - b - 1));
+        size_t row = strtoull(rowText.c_str(), nullptr, 10);
+        uint64_t hash = strtoull(hashText.c_str(), nullptr, 16);
+
+        auto [it, inserted] = previous.try_emplace({ row, hash });
+        if (inserted || rank(mark) >= rank(it->second.mark)) {
+            it->second.mark = mark;
+            it->second.value = string(line.substr(c + 1));
+        }
+    }
+
+    JournalOptions options;
+    int fd = -1;
+
+    map<RowKey, RowState> previous;     // loaded at startup
+    set<RowKey> settled;                // snapshot for the next run
+
+    string buffer;
+    size_t buffered = 0;
+    chrono::steady_clock::time_point oldestBuffered;
+};
+
+// --- Jobs ---
+// A job is one sheet tab and the Dropbox folder its images go to. Without
+// --jobs there is a single job: the sheet from Configuration.h and the folder
+// argument. A manifest is a JSON array of jobs; every field but "folder"
+// defaults to Configuration.h:
+//
+//   [{ "folder": "/Images/Spring", "sheet": "<spreadsheet id>", "tab": "Images",
+//      "csv": "<CSV export URL>", "image_column": 0, "link_column": 1,
+//      "name_column": 2 }]
+//
+// A job naming its own sheet but no "csv" is read through the gviz CSV export
+// of that tab. Columns are 0-based, as in Configuration.h.
+
+struct JobSpec {
+    string dropboxFolder;           // always ends in '/'
+    string csvUrl;
+    string sheetId = GOOGLE_SHEET_ID;
+    string tab = "Images";
+    int imageColumn = IMAGE_COLUMN_INDEX;
+    int linkColumn = 1;
+    int fileNameColumn = FILENAME_COLUMN_INDEX;
+
+    string label() const { return tab + " -> " + dropboxFolder; }
+
+    // The columns a run reads, each once, for --read-sheet
+    vector<int> columns() const {
+        vector<int> used = { imageColumn, linkColumn, fileNameColumn };
+        sort(used.begin(), used.end());
+        used.erase(unique(used.begin(), used.end()), used.end());
+        return used;
+    }
+};
+
+JobSpec defaultJob(string dropboxFolder) {
+    JobSpec job;
+    if (dropboxFolder.back() != '/')
+        dropboxFolder += '/';
+    job.dropboxFolder = dropboxFolder;
+    job.csvUrl = serviceUrls().csv;
+    return job;
+}
+
+bool readJobManifest(const string& path, vector<JobSpec>& jobs, string& error) {
+    ifstream in(path, ios::binary);
+    if (!in) {
+        error = "cannot read " + path;
+        return false;
+    }
+    string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+    auto column = [&](string_view entry, const char* key, int fallback, int& out) {
+        string_view raw = jsonMember(entry, key);
+        out = raw.empty() ? fallback : int(jsonNumber(raw, -1));
+        return out >= 0;
+    };
+
+    string_view entry;
+    JsonElements entries(text);
+    while (entries.next(entry)) {
+        string folder = jsonString(jsonMember(entry, "folder"));
+        if (folder.empty()) {
+            error = "job " + to_string(jobs.size() + 1) + " has no \"folder\"";
+            return false;
+        }
+
+        JobSpec job = defaultJob(folder);
+        string_view sheet = jsonMember(entry, "sheet");
+        string_view tab = jsonMember(entry, "tab");
+        string_view csv = jsonMember(entry, "csv");
+        if (!sheet.empty()) job.sheetId = jsonString(sheet);
+        if (!tab.empty()) job.tab = jsonString(tab);
+        if (!csv.empty())
+            job.csvUrl = jsonString(csv);
+        else if (!sheet.empty())
+            job.csvUrl = "https://docs.google.com/spreadsheets/d/" + urlEncode(job.sheetId) +
+                "/gviz/tq?tqx=out:csv&sheet=" + urlEncode(job.tab);
+
+        if (!column(entry, "image_column", IMAGE_COLUMN_INDEX, job.imageColumn) ||
+            !column(entry, "link_column", 1, job.linkColumn) ||
+            !column(entry, "name_column", FILENAME_COLUMN_INDEX, job.fileNameColumn))
+        {
+            error = "job " + to_string(jobs.size() + 1) + " has a bad column index";
+            return false;
+        }
+        jobs.push_back(move(job));
+    }
+
+    if (jobs.empty())
+        error = path + " holds no jobs";
+    return !jobs.empty();
+}
+
+// --- Row pipeline ---
+// Rows move through download -> upload -> link create (or lookup), and the new
+// link is handed to the SheetWriter. Each stage has its own in-flight limit; all
+// transfers share one TransferLoop.
+
+struct PipelineLimits {
+    size_t rows = 16;       // rows admitted into the pipeline at once
+    size_t download = 8;
+    size_t upload = 4;
+    size_t link = 4;        // create_shared_link_with_settings + list_shared_links
+    size_t sheet = 2;       // values:batchUpdate requests
+};
+
+// --shard=k/N: this process handles shard k of N, counted from 1. Rows go
+// to shards by a hash of their target file name, lowercased and without the
+// extension, so rows that would land on the same Dropbox path always share
+// a shard: autorename then resolves their clashes within one process, as it
+// would without sharding, and shards never race each other for a name.
+struct ShardOptions {
+    size_t index = 0;
+    size_t count = 1;
+
+    bool enabled() const { return count > 1; }
+
+    bool owns(string_view fileName) const {
+        if (!enabled()) return true;
+        size_t dot = fileName.rfind('.');
+        string stem = lowercase(string(fileName.substr(0, dot == string_view::npos ? fileName.size() : dot)));
+        return fnv1a({ stem }) % count == index;
+    }
+
+    string label() const { return to_string(index + 1) + "/" + to_string(count); }
+};
+
+bool parseShard(const string& value, ShardOptions& shard) {
+    char* end = nullptr;
+    unsigned long k = strtoul(value.c_str(), &end, 10);
+    if (end == value.c_str() || *end != '/') return false;
+    unsigned long n = strtoul(end + 1, &end, 10);
+    if (*end != '\0' || k == 0 || k > n) return false;
+
+    shard.index = k - 1;
+    shard.count = n;
+    return true;
+}
+
+struct StreamOptions {
+    bool enabled = false;           // --stream
+    size_t bufferBytes = 256 * 1024;
+};
+
+struct CacheOptions {
+    bool enabled = true;            // --no-cache turns it off
+    string path = ".uploader-cache";
+};
+
+struct TokenCacheOptions {
+    bool enabled = true;            // --no-token-cache turns it off
+    string path = ".uploader-tokens";
+};
+
+struct Options {
+    PipelineLimits limits;
+    SheetWriteOptions sheetWrites;
+    StreamOptions streaming;
+    UploadSessionOptions sessions;
+    ImageLimits images;
+    MemoryOptions memory;
+    CacheOptions cache;
+    JournalOptions journal;
+    TokenCacheOptions tokens;
+    RateOptions rates;
+    TransportOptions transport;
+    ReportOptions report;
+    bool prefetchLinks = true;      // --no-link-prefetch turns it off
+    bool indexFolder = true;        // --no-folder-index turns it off
+    string jobsPath;                // --jobs, a job manifest
+    ShardOptions shard;
+    SaveUrlOptions saveUrl;
+    BatchCommitOptions batchCommit;
+    CsvStreamOptions csvStream;
+    SheetReadOptions sheetRead;
+    bool mergeReports = false;      // --merge-reports: combine shard reports, no run
+};
+
+bool parseOption(const string& arg, Options& options) {
+    if (arg == "--stream") {
+        options.streaming.enabled = true;
+        return true;
+    }
+    if (arg == "--no-cache") {
+        options.cache.enabled = false;
+        return true;
+    }
+    if (arg == "--no-journal") {
+        options.journal.enabled = false;
+        return true;
+    }
+    if (arg == "--no-token-cache") {
+        options.tokens.enabled = false;
+        return true;
+    }
+    if (arg == "--no-link-prefetch") {
+        options.prefetchLinks = false;
+        return true;
+    }
+    if (arg == "--no-folder-index") {
+        options.indexFolder = false;
+        return true;
+    }
+    if (arg == "--batch-commit") {
+        options.batchCommit.enabled = true;
+        return true;
+    }
+    if (arg == "--save-url") {
+        options.saveUrl.enabled = true;
+        return true;
+    }
+    if (arg == "--read-sheet") {
+        options.sheetRead.enabled = true;
+        return true;
+    }
+    if (arg == "--http2") {
+        options.transport.http2 = true;
+        return true;
+    }
+    if (arg == "--merge-reports") {
+        options.mergeReports = true;
+        return true;
+    }
+
+    size_t eq = arg.find('=');
+    if (eq == string::npos) return false;
+
+    string name = arg.substr(0, eq);
+    string value = arg.substr(eq + 1);
+
+    if (name == "--cache") {
+        options.cache.path = value;
+        return !value.empty();
+    }
+    if (name == "--journal") {
+        options.journal.path = value;
+        return !value.empty();
+    }
+    if (name == "--token-cache") {
+        options.tokens.path = value;
+        return !value.empty();
+    }
+    if (name == "--shard")
+        return parseShard(value, options.shard);
+    if (name == "--stream-csv") {
+        options.csvStream.outPath = value;
+        return !value.empty();
+    }
+    if (name == "--jobs") {
+        options.jobsPath = value;
+        return !value.empty();
+    }
+    if (name == "--spill-dir") {
+        options.memory.spillDir = value;
+        return !value.empty();
+    }
+    if (name == "--report-json") {
+        options.report.jsonPath = value;
+        return !value.empty();
+    }
+    if (name == "--report-prom") {
+        options.report.prometheusPath = value;
+        return !value.empty();
+    }
+
+    char* end = nullptr;
+    unsigned long n = strtoul(value.c_str(), &end, 10);
+    if (value.empty() || *end != '\0' || n == 0) return false;
+
+    PipelineLimits& limits = options.limits;
+    if (name == "--concurrency") limits.rows = n;
+    else if (name == "--download-concurrency") limits.download = n;
+    else if (name == "--upload-concurrency") limits.upload = n;
+    else if (name == "--link-concurrency") limits.link = n;
+    else if (name == "--sheet-concurrency") limits.sheet = n;
+    else if (name == "--sheet-batch-size") options.sheetWrites.batchCells = n;
+    else if (name == "--sheet-flush-ms") options.sheetWrites.flushIntervalMs = long(n);
+    else if (name == "--stream-buffer") options.streaming.bufferBytes = max<size_t>(n, CURL_MAX_WRITE_SIZE);
+    else if (name == "--session-threshold") options.sessions.thresholdBytes = n;
+    else if (name == "--chunk-size") options.sessions.chunkBytes = n;
+    else if (name == "--chunk-retries") options.sessions.chunkRetries = int(n);
+    else if (name == "--batch-size") options.batchCommit.maxEntries = min<size_t>(n, 1000);
+    else if (name == "--batch-linger-ms") options.batchCommit.lingerMs = long(n);
+    else if (name == "--max-image-bytes") options.images.maxBytes = n;
+    else if (name == "--memory-budget") options.memory.budgetBytes = n;
+    else if (name == "--spill-threshold") options.memory.spillBytes = n;
+    else if (name == "--journal-batch") options.journal.batchRecords = n;
+    else if (name == "--journal-sync-ms") options.journal.syncIntervalMs = long(n);
+    else if (name == "--upload-rate") options.rates.uploadPerSecond = n;
+    else if (name == "--api-rate") options.rates.apiPerSecond = n;
+    else if (name == "--sheet-rate") options.rates.sheetsPerSecond = n;
+    else if (name == "--retries") options.rates.maxRetries = int(n);
+    else if (name == "--max-streams") options.transport.maxStreams = n;
+    else if (name == "--reorder-window") options.csvStream.window = n;
+    else if (name == "--read-block") options.sheetRead.blockRows = n;
+    else return false;
+
+    return true;
+}
+
+// Stream is download and upload together, joined by a StreamPipe (--stream).
+// SaveUrl has Dropbox fetch the image (--save-url).
+enum class RowStage { Download, Upload, Stream, SaveUrl, LinkLookup, LinkCreate, Done };
+
+struct RowJob {
+    explicit RowJob(const ImageLimits& images) : image(images) {}
+
+    size_t index = 0;
+    uint64_t rowHash = 0;           // journal key, from the cells as read
+    RowStage stage = RowStage::Download;
+    bool finished = false;
+
+    string imageUrl;
+    string fileName;
+    bool extensionGuessed = false;  // ".jpg" added for want of one; the bytes decide
+    ImageCheck image;
+    Payload imageData;
+    size_t reserved = 0;            // share of the PayloadBudget held
+    string contentHash;
+    DownloadValidators validators;  // from a full (200) download
+    bool notModified = false;       // source answered 304
+    bool reused = false;            // served from the upload cache
+    unique_ptr<UploadSession> session;
+    unique_ptr<StreamPipe> pipe;
+    string saveJobId;               // save_url job Dropbox is still running
+    string commitSession;           // --batch-commit: closed session awaiting its batch
+    size_t commitBytes = 0;
+    int commitConflicts = 0;
+    string actualPath;
+    string dropboxLink;
+
+    // Output is buffered per row and flushed in row order so the log reads
+    // exactly like the serial loop did.
+    ostringstream out;
+    ostringstream err;
+};
+
+// Rows and transfers in flight across every job's pipeline, so the limits
+// and the payload budget hold for the whole process rather than per sheet.
+struct RowCapacity {
+    // Stages that share an in-flight limit share a slot.
+    enum Slot { DownloadSlot, UploadSlot, LinkSlot, SlotCount };
+
+    RowCapacity(const PipelineLimits& limits, const MemoryOptions& memory)
+        : limits(limits), memory(memory), budget(this->memory) {}
+
+    size_t limitFor(Slot slot) const {
+        switch (slot) {
+        case DownloadSlot: return limits.download;
+        case UploadSlot: return limits.upload;
+        default: return limits.link;
+        }
+    }
+
+    bool hasRoom(Slot slot) const { return active[slot] < limitFor(slot); }
+    bool rowsFull() const { return rows >= limits.rows; }
+
+    PipelineLimits limits;
+    MemoryOptions memory;
+    PayloadBudget budget;
+    size_t rows = 0;                // admitted and not finished
+    size_t active[SlotCount] = {};
+    size_t commits = 0;             // finish_batch_v2 calls out; one at a time for the namespace
+};
+
+using Slot = RowCapacity::Slot;
+
+class RowPipeline {
+public:
+    RowPipeline(
+        TransferLoop& loop,
+        RowCapacity& capacity,
+        SheetWriter& sheetWriter,
+        const JobSpec& spec,
+        const StreamOptions& streaming,
+        const UploadSessionOptions& sessions,
+        const ImageLimits& images,
+        const ShardOptions& shard,
+        const SaveUrlOptions& saveUrl,
+        const BatchCommitOptions& batch,
+        UploadCache& cache,
+        RunJournal& journal,
+        const unordered_map<string, string>& folderLinks,
+        const FolderIndex& folderFiles,
+        const string& dropboxAccessToken,
+        CsvTable& table)
+        : loop(loop), capacity(capacity), sheetWriter(sheetWriter), spec(spec),
+          streaming(streaming), sessions(sessions), images(images), shard(shard), saveUrl(saveUrl),
+          batch(batch), cache(cache), journal(journal), folderLinks(folderLinks), folderFiles(folderFiles),
+          dropboxFolder(spec.dropboxFolder),
+          dropboxFolderLower(lowercase(spec.dropboxFolder)),
+          dropboxAccessToken(dropboxAccessToken), table(table)
+    {
+        sheetWriter.onWritten = [this](int sheetRow, bool ok) { rowWritten(sheetRow, ok); };
+    }
+
+    // Prefixed to every log line, to tell jobs apart when several run.
+    string logPrefix;
+
+    // --stream-csv: the export still arriving through feed, and where
+    // finished rows are written, in order, and then dropped from the table.
+    CsvFeed* feed = nullptr;
+    ostream* csvOut = nullptr;
+
+    // Admits rows until one of them stays in flight. False when there was
+    // no row left to admit.
+    bool admitNext() {
+        size_t before = nextToAdmit;
+        size_t inFlight = capacity.rows;
+        while (nextToAdmit < table.rowCount() && capacity.rows == inFlight)
+            admitRow(nextToAdmit++);
+        return nextToAdmit != before;
+    }
+
+    bool allAdmitted() const { return table.finished() && nextToAdmit >= table.rowCount(); }
+
+    // Starts the next queued stage in slot. False when nothing is queued
+    // there or its payload does not fit the budget yet.
+    bool startNext(Slot slot) {
+        if (queued[slot].empty())
+            return false;
+
+        RowJob* job = queued[slot].front();
+        // Out of payload memory: wait for an upload to hand some back
+        if (!reservePayload(*job))
+            return false;
+        queued[slot].pop_front();
+        start(*job);
+        return true;
+    }
+
+    void tick() {
+        sheetWriter.tick();
+        journal.tick();
+        if (feed) feed->tick();
+        pollSaves();
+        commitBatch();
+    }
+
+    // Rows held off the transfer loop: Dropbox still fetching them
+    // (--save-url) between poll rounds, or closed sessions waiting for
+    // their batch (--batch-commit).
+    bool waiting() const { return !saving.empty() || !toCommit.empty(); }
+
+    // How long until the next poll round, capped at limit.
+    long msUntilPoll(long limit) const {
+        if (saving.empty() || pollsOut > 0)
+            return limit;
+        auto wait = chrono::duration_cast<chrono::milliseconds>(pollAt - chrono::steady_clock::now()).count();
+        return max<long>(0, min<long>(limit, long(wait)));
+    }
+
+    // After the last transfer: the rows still unprinted and the summary.
+    void finishRows() {
+        flushFinishedRows();
+        writeRows(table.rowCount());
+        if (csvOut) *csvOut << flush;
+        if (unchangedRows > 0)
+            writeLog(cout, "Skipped " + to_string(unchangedRows) + " rows unchanged since the last run\n");
+        if (otherShardRows > 0)
+            writeLog(cout, "Shard " + shard.label() + ": left " + to_string(otherShardRows) + " rows to the other shards\n");
+    }
+
+    // Sends what the sheet writer still holds; false once it is idle.
+    bool flushSheet() {
+        if (sheetWriter.idle())
+            return false;
+        sheetWriter.flush();
+        return true;
+    }
+
+private:
+    static Slot slotFor(RowStage stage) {
+        switch (stage) {
+        case RowStage::Download: return RowCapacity::DownloadSlot;
+        case RowStage::Upload:
+        case RowStage::Stream:
+        case RowStage::SaveUrl: return RowCapacity::UploadSlot;
+        default: return RowCapacity::LinkSlot;
+        }
+    }
+
+    void admitRow(size_t i) {
+        rows.push_back(make_unique<RowJob>(images));
+        RowJob& job = *rows.back();
+        job.imageData.spillTo(capacity.memory);
+        job.index = i;
+        job.rowHash = rowHash(i);
+        ++capacity.rows;
+
+        // Settled last time and not edited since: nothing to do
+        const RunJournal::RowState* resumed = journal.find(i, job.rowHash);
+        if (resumed && (resumed->mark == RunJournal::Written || resumed->mark == RunJournal::Settled)) {
+            journal.keep(i, job.rowHash);
+            ++unchangedRows;
+            finishRow(job);
+            return;
+        }
+
+        string cell = trim(table.cell(i, spec.imageColumn));
+        string existingLink = trim(table.cell(i, spec.linkColumn));
+
+        // Expected filename (Column C)
+        string expectedFileName = table.cell(i, spec.fileNameColumn);
+        if (expectedFileName.empty())
+            expectedFileName = "image_" + to_string(i + 1);
+
+        if (!shard.owns(expectedFileName)) {
+            ++otherShardRows;
+            finishRow(job);
+            return;
+        }
+
+        // No extension given: the downloaded bytes pick the real one
+        bool extensionGuessed = expectedFileName.find('.') == string::npos;
+        string linkName = extensionGuessed ? expectedFileName + "." : expectedFileName;
+        if (extensionGuessed)
+            expectedFileName += ".jpg";
+
+        // Skip ONLY if Dropbox link already matches filename
+        if (!existingLink.empty() &&
+            existingLink.find("dropbox.com") != string::npos &&
+            dropboxLinkMatchesFilename(existingLink, linkName))
+        {
+            job.out << "Skipping row " << i + 2 << " (Dropbox link matches filename)" << endl;
+            journal.record(RunJournal::Settled, i, job.rowHash);
+            finishRow(job);
+            return;
+        }
+
+        // Not an image URL: nothing to fetch
+        if (cell.empty() || cell.rfind("http", 0) != 0) {
+            journal.record(RunJournal::Settled, i, job.rowHash);
+            finishRow(job);
+            return;
+        }
+
+        job.imageUrl = cell;
+        job.fileName = expectedFileName;
+        job.extensionGuessed = extensionGuessed;
+
+        // Pick up after the last stage a crashed run finished. A row that
+        // was only downloaded starts over, since the bytes were not kept.
+        if (resumed && resumed->mark == RunJournal::Linked) {
+            job.out << "Resuming " << job.fileName << " (linked before restart)" << endl;
+            job.dropboxLink = resumed->value;
+            linkReady(job);
+            return;
+        }
+        if (resumed && resumed->mark == RunJournal::Uploaded) {
+            job.out << "Resuming " << job.fileName << " (uploaded before restart)" << endl;
+            job.actualPath = resumed->value;
+            resolveLink(job);
+            return;
+        }
 
+        if (reuseFolderFile(job))
+            return;
 
-    curl_easy_setopt(curl, CURLOPT_URL,
-        "https://content.dropboxapi.com/2/files/upload");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POST, 1L);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, fileData.data());
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, fileData.size());
-    responseOut.clear();
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeTextCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &responseOut);
+        // Dropbox can only fetch what it can reach, and cannot say what a
+        // guessed extension should have been
+        if (saveUrl.enabled && !job.extensionGuessed && publicUrl(job.imageUrl)) {
+            enqueue(job, RowStage::SaveUrl);
+            return;
+        }
+        enqueueFetch(job);
+    }
 
+    // The bytes come through here: downloaded then uploaded, or streamed.
+    void enqueueFetch(RowJob& job) {
+        enqueue(job, streaming.enabled ? RowStage::Stream : RowStage::Download);
+    }
 
-    CURLcode res = curl_easy_perform(curl);
+    void enqueue(RowJob& job, RowStage stage) {
+        job.stage = stage;
+        queued[slotFor(stage)].push_back(&job);
+    }
 
+    // What a stage may buffer: a download up to the spill threshold, a
+    // stream its ring.
+    bool reservePayload(RowJob& job) {
+        size_t bytes = 0;
+        if (job.stage == RowStage::Download) bytes = capacity.budget.spillBytes();
+        else if (job.stage == RowStage::Stream) bytes = streaming.bufferBytes;
+        if (bytes == 0 || job.reserved > 0)
+            return true;
+        if (!capacity.budget.reserve(bytes))
+            return false;
+        job.reserved = bytes;
+        return true;
+    }
 
-    if (!responseOut.empty()) {
-        //  cerr << "[uploadToDropbox] Dropbox response: " << responseOut << endl;
+    void keepReserved(RowJob& job, size_t bytes) {
+        if (bytes >= job.reserved) return;
+        capacity.budget.release(job.reserved - bytes);
+        job.reserved = bytes;
     }
-    else {
-        //  cerr << "[uploadToDropbox] Dropbox response empty\n";
+
+    void releasePayload(RowJob& job) {
+        job.imageData.clear();
+        keepReserved(job, 0);
     }
 
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    unique_ptr<HttpRequest> makeRequest(RowJob& job) {
+        switch (job.stage) {
+        case RowStage::Download:
+            return makeDownloadImageRequest(job.imageUrl, job.image, job.imageData, conditionalValidators(job));
+        case RowStage::Upload:
+            if (job.imageData.size() > sessions.thresholdBytes) {
+                if (!job.session) job.session = make_unique<UploadSession>();
+                return makeUploadSessionRequest(dropboxAccessToken, job.imageData.view(),
+                    dropboxFolder + job.fileName, *job.session, sessions);
+            }
+            if (batch.enabled)
+                return makeClosedSessionRequest(dropboxAccessToken, job.imageData.view());
+            return makeUploadRequest(dropboxAccessToken, job.imageData.view(), dropboxFolder + job.fileName);
+        case RowStage::SaveUrl:
+            return makeSaveUrlRequest(dropboxAccessToken, job.imageUrl, dropboxFolder + job.fileName);
+        case RowStage::LinkLookup:
+            return makeExistingSharedLinkRequest(dropboxAccessToken, job.actualPath);
+        case RowStage::LinkCreate:
+            return makeCreateShareLinkRequest(dropboxAccessToken, job.actualPath, job.err);
+        default:
+            return nullptr;
+        }
+    }
 
-    bool success = (res == CURLE_OK);
-    // cerr << "[uploadToDropbox] EXIT, success=" << success << endl;
-    return success;
-}
+    void start(RowJob& job) {
+        if (job.stage == RowStage::Stream) {
+            startStream(job);
+            return;
+        }
 
-bool createDropboxShareLink(
-    const string& accessToken,
-    const string& dropboxPath,
-    string& outLink)
-{
-    cerr << "[createDropboxShareLink] ENTER, path=" << dropboxPath << endl;
+        Slot slot = slotFor(job.stage);
+        unique_ptr<HttpRequest> req = makeRequest(job);
 
-    CURL* curl = curl_easy_init();
-    if (!curl) {
-        cerr << "[createDropboxShareLink] CURL init failed\n";
-        return false;
-    }
+        if (!req) {
+            // Same outcome as a failed transfer for this stage
+            HttpRequest failed;
+            failed.result = CURLE_FAILED_INIT;
+            onStageDone(job, failed);
+            return;
+        }
 
+        ++capacity.active[slot];
+        req->onDone = [this, &job, slot](HttpRequest& done) {
+            --capacity.active[slot];
+            onStageDone(job, done);
+        };
+        loop.add(move(req));
+    }
 
-    struct curl_slist* headers = nullptr;
+    void onStageDone(RowJob& job, HttpRequest& req) {
+        switch (job.stage) {
+        case RowStage::Download:
+            if (req.result == CURLE_OK && req.status == 304) {
+                releasePayload(job);
+                if (reuseUnmodified(job))
+                    return;
+            }
 
-    addDropboxBusinessHeaders(headers, accessToken);
-    addDropboxNamespaceHeader(headers);
+            job.validators = downloadValidators(req);
+            if (!finishDownloadImage(req, job.image, job.imageData)) {
+                failDownload(job);
+                return;
+            }
+            applyExtension(job);
+
+            // Spilled bytes live on disk now; only a heap body still counts
+            keepReserved(job, job.imageData.spilled() ? 0 : job.imageData.size());
+            job.contentHash = dropboxContentHash(job.imageData.view());
+            journal.record(RunJournal::Downloaded, job.index, job.rowHash, job.contentHash);
+            if (reuseCachedUpload(job))
+                return;
+
+            enqueue(job, RowStage::Upload);
+            return;
+
+        case RowStage::Upload: {
+            string dropboxResponse;
+
+            if (job.session) {
+                SessionStep step = finishUploadSessionStep(req, *job.session, sessions, dropboxResponse);
+                if (step == SessionStep::More) {
+                    enqueue(job, RowStage::Upload);
+                    return;
+                }
+                job.session.reset();
+                releasePayload(job);
+                uploadCompleted(job, step == SessionStep::Done, dropboxResponse);
+                return;
+            }
 
-    headers = curl_slist_append(headers,
-        "Content-Type: application/json");
+            if (batch.enabled) {
+                job.commitSession = finishClosedSession(req);
+                job.commitBytes = job.imageData.size();
+                releasePayload(job);
+                if (job.commitSession.empty()) {
+                    uploadCompleted(job, false, "");
+                    return;
+                }
+                awaitCommit(job);
+                return;
+            }
 
+            bool uploaded = finishUploadToDropbox(req, dropboxResponse);
+            releasePayload(job);
+            uploadCompleted(job, uploaded, dropboxResponse);
+            return;
+        }
 
-    string jsonPayload = "{\"path\":\"" + dropboxPath + "\",\"settings\":{\"requested_visibility\":\"public\"}}";
+        case RowStage::SaveUrl:
+            saveUrlAnswered(job, req);
+            return;
 
-    string response;
-    curl_easy_setopt(curl, CURLOPT_URL,
-        "https://api.dropboxapi.com/2/sharing/create_shared_link_with_settings");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POST, 1L);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, jsonPayload.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeBinaryCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+        case RowStage::LinkLookup:
+            job.dropboxLink = finishGetExistingSharedLink(req, job.err);
+            if (job.dropboxLink.empty()) {
+                job.err << "Failed to create shared link for " << job.fileName << endl;
+                finishRow(job);
+                return;
+            }
+            linkReady(job);
+            return;
+
+        case RowStage::LinkCreate:
+            if (sharedLinkAlreadyExists(req, job.dropboxLink)) {
+                if (job.dropboxLink.empty())
+                    enqueue(job, RowStage::LinkLookup);
+                else
+                    linkReady(job);
+                return;
+            }
+            if (!finishCreateDropboxShareLink(req, job.dropboxLink, job.err)) {
+                job.err << "Failed to create shared link for " << job.fileName << endl;
+                finishRow(job);
+                return;
+            }
+            linkReady(job);
+            return;
 
-    CURLcode res = curl_easy_perform(curl);
-    // cerr << "[createDropboxShareLink] after perform, res=" << res << endl;
-    if (!response.empty()) {
-        //  cerr << "[createDropboxShareLink] Dropbox response: " << response << endl;
-    }
-    else {
-        // cerr << "[createDropboxShareLink] Dropbox response empty\n";
+        default:
+            return;
+        }
     }
 
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    void startStream(RowJob& job) {
+        job.pipe = make_unique<StreamPipe>(loop, streaming.bufferBytes);
+        StreamPipe& pipe = *job.pipe;
+
+        unique_ptr<HttpRequest> download =
+            makeDownloadImageRequest(job.imageUrl, job.image, job.imageData, conditionalValidators(job));
+        if (!download) {
+            job.pipe.reset();
+            HttpRequest failed;
+            failed.result = CURLE_FAILED_INIT;
+            job.stage = RowStage::Download;
+            onStageDone(job, failed);
+            return;
+        }
 
-    if (res != CURLE_OK) {
-        // cerr << "[createDropboxShareLink] CURL failed: " << curl_easy_strerror(res) << endl;
-        return false;
-    }
+        job.image.attach(*download, nullptr);
+        curl_easy_setopt(download->curl, CURLOPT_WRITEFUNCTION, streamWriteCallback);
+        curl_easy_setopt(download->curl, CURLOPT_WRITEDATA, &pipe);
+        // The halves feed each other, so neither can be replayed on its own
+        download->retry = RetryPolicy::Never;
+        pipe.download = download->curl;
+        pipe.image = &job.image;
+
+        ++capacity.active[RowCapacity::UploadSlot];
+
+        pipe.startUpload = [this, &job]() {
+            StreamPipe& pipe = *job.pipe;
+            applyExtension(job);
+
+            unique_ptr<HttpRequest> upload = makeStreamingUploadRequest(dropboxAccessToken, dropboxFolder + job.fileName, pipe);
+            if (!upload) {
+                // Ends the download on its next chunk; the row reports the upload failure
+                pipe.uploadDone = true;
+                return;
+            }
 
-    size_t urlPos = response.find("\"url\":");
-    if (urlPos == string::npos) {
-        cerr << "[createDropboxShareLink] URL not found in response\n";
-        return false;
-    }
+            upload->retry = RetryPolicy::Never;
+            pipe.upload = upload->curl;
+            upload->onDone = [this, &job](HttpRequest& done) {
+                StreamPipe& pipe = *job.pipe;
+                pipe.upload = nullptr;
+                pipe.uploadDone = true;
+                pipe.uploadOk = finishUploadToDropbox(done, pipe.uploadResponse);
+                pipe.uploadThrottled = throttled(done);
+                // A download paused on a full ring has to wake up to notice
+                pipe.wakeDownload();
+                streamFinished(job);
+            };
+            loop.addLater(move(upload));
+        };
+
+        download->onDone = [this, &job](HttpRequest& done) {
+            StreamPipe& pipe = *job.pipe;
+            pipe.download = nullptr;
+            pipe.downloadDone = true;
+            bool checked = job.image.finish(done.result);
+            pipe.downloadOk = done.result == CURLE_OK && done.status < 400 && pipe.bytesIn > 0 && checked;
+            job.notModified = done.result == CURLE_OK && done.status == 304;
+            job.validators = downloadValidators(done);
+
+            // A body too short to sniff mid-transfer is decided here; with no
+            // usable body at all the upload never starts
+            if (pipe.downloadOk)
+                pipe.releaseUpload();
+            if (pipe.startUpload) {
+                pipe.startUpload = nullptr;
+                pipe.upload = nullptr;
+                pipe.uploadDone = true;
+            }
+            pipe.wakeUpload();
+            streamFinished(job);
+        };
 
-    size_t start = response.find("\"", urlPos + 6);
-    size_t end = response.find("\"", start + 1);
-    if (start == string::npos || end == string::npos) {
-        cerr << "[createDropboxShareLink] URL parse failed\n";
-        return false;
+        loop.add(move(download));
     }
 
-    string url = response.substr(start + 1, end - start - 1);
-    size_t dlPos = url.find("?dl=0");
-    if (dlPos != string::npos)
-        url.replace(dlPos, 5, "?dl=1");
+    // Runs after each half of a stream; the row moves on once both are done.
+    void streamFinished(RowJob& job) {
+        StreamPipe& pipe = *job.pipe;
+        if (!pipe.downloadDone || !pipe.uploadDone)
+            return;
+
+        --capacity.active[RowCapacity::UploadSlot];
+        bool downloadFailed = !pipe.downloadOk && !pipe.downloadCutOff;
+        bool uploadOk = pipe.uploadOk;
+        bool uploadThrottled = pipe.uploadThrottled;
+        string dropboxResponse = move(pipe.uploadResponse);
+        if (pipe.downloadOk) job.contentHash = pipe.hasher.finish();
+        job.pipe.reset();
+        releasePayload(job);
+
+        // Nothing was uploaded; the cached copy stands
+        if (job.notModified && reuseUnmodified(job))
+            return;
+
+        if (downloadFailed) {
+            failDownload(job);
+            return;
+        }
 
-    outLink = url;
-    //cerr << "[createDropboxShareLink] EXIT, outLink=" << outLink << endl;
-    return true;
-}
+        // The buffered path can wait out the throttling and retry
+        if (!uploadOk && uploadThrottled) {
+            job.contentHash.clear();
+            enqueue(job, RowStage::Download);
+            return;
+        }
 
-size_t WriteCallback(void* contents, size_t size, size_t nmemb, void* userp) {
-    ((string*)userp)->append((char*)contents, size * nmemb);
-    return size * nmemb;
-}
+        uploadCompleted(job, uploadOk, dropboxResponse);
+    }
 
-string getExistingSharedLink(const string& accessToken, const string& dropboxPath) {
-    CURL* curl = curl_easy_init();
-    if (!curl) return "";
+    void failDownload(RowJob& job) {
+        job.err << "Failed to download image from " << job.imageUrl;
+        if (!job.image.reason().empty())
+            job.err << " (" << job.image.reason() << ")";
+        job.err << endl;
+        finishRow(job);
+    }
 
-    string readBuffer;
+    // A name that came without an extension takes the one the bytes showed.
+    void applyExtension(RowJob& job) {
+        const string& extension = job.image.extension();
+        if (!job.extensionGuessed || extension.empty())
+            return;
+        job.fileName.replace(job.fileName.size() - 4, 4, extension);
+        job.extensionGuessed = false;
+    }
 
-    curl_easy_setopt(curl, CURLOPT_URL, "https://api.dropboxapi.com/2/sharing/list_shared_links");
-    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    // Validators are only worth sending when a 304 can be answered from the
+    // cache, i.e. the URL's last content is this row's known upload.
+    const DownloadValidators* conditionalValidators(RowJob& job) {
+        string hash;
+        UploadCache::Entry entry;
+        if (!cache.findHashForUrl(job.imageUrl, hash) ||
+            !cache.findByHash(hash, entry) ||
+            !uploadedAs(entry.pathLower, job.fileName) ||
+            !cache.findValidators(job.imageUrl, job.validators) ||
+            job.validators.empty())
+        {
+            return nullptr;
+        }
+        return &job.validators;
+    }
 
-    string jsonData = "{\"path\":\"" + dropboxPath + "\", \"direct_only\": true}";
+    bool reuseUnmodified(RowJob& job) {
+        job.validators = DownloadValidators();
+        if (!cache.findHashForUrl(job.imageUrl, job.contentHash))
+            return false;
+        return reuseCachedUpload(job, "not modified, uploaded as ");
+    }
 
-    struct curl_slist* headers = nullptr;
+    // Whether pathLower is this folder's file for fileName, or the numbered
+    // name autorename gave it on a clash. Rows sharing an image under other
+    // names still get files of their own.
+    bool uploadedAs(const string& pathLower, const string& fileName) const {
+        if (pathLower.rfind(dropboxFolderLower, 0) != 0)
+            return false;
+        string_view name = string_view(pathLower).substr(dropboxFolderLower.size());
+        string wanted = lowercase(fileName);
+        if (name == wanted)
+            return true;
+
+        // "stem (N).ext"
+        size_t dot = wanted.rfind('.');
+        string_view stem = string_view(wanted).substr(0, dot);
+        string_view extension = dot == string::npos ? string_view() : string_view(wanted).substr(dot);
+        if (name.size() <= stem.size() + extension.size() || !name.starts_with(stem) || !name.ends_with(extension))
+            return false;
+        string_view number = name.substr(stem.size(), name.size() - stem.size() - extension.size());
+        return number.size() > 3 && number.starts_with(" (") && number.ends_with(")") &&
+            all_of(number.begin() + 2, number.end() - 1, [](char c) { return c >= '0' && c <= '9'; });
+    }
 
-    addDropboxBusinessHeaders(headers, accessToken);
-    addDropboxNamespaceHeader(headers);
+    // Same bytes already uploaded as this row's file: take the cached path
+    // and link and skip the upload and link calls.
+    bool reuseCachedUpload(RowJob& job, const char* reason = "already uploaded as ") {
+        UploadCache::Entry entry;
+        if (!cache.findByHash(job.contentHash, entry))
+            return false;
+        if (!uploadedAs(entry.pathLower, job.fileName))
+            return false;
+
+        releasePayload(job);
+        job.actualPath = entry.pathLower;
+        job.dropboxLink = entry.link;
+        job.reused = true;
+
+        job.out << "Unchanged " << job.fileName << " (" << reason << job.actualPath << ")" << endl;
+        linkReady(job);
+        return true;
+    }
 
-    headers = curl_slist_append(headers,
-        "Content-Type: application/json");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    void rowWritten(int sheetRow, bool ok) {
+        size_t i = size_t(sheetRow - 1);
+        auto written = writtenHashes.find(i);
+        if (written == writtenHashes.end())
+            return;
+        if (ok) journal.record(RunJournal::Written, i, written->second);
+        writtenHashes.erase(written);
+    }
 
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, jsonData.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &readBuffer);
+    // A file by this name is already in the folder: link it rather than
+    // upload a renamed copy. Skipped when the upload cache knows the source
+    // has since changed.
+    bool reuseFolderFile(RowJob& job) {
+        const FolderFile* file = folderFiles.findByName(lowercase(job.fileName));
+        if (!file && job.extensionGuessed) {
+            // Uploaded by an earlier run under whatever extension its bytes had
+            string stem = lowercase(job.fileName.substr(0, job.fileName.size() - 4));
+            for (const char* extension : IMAGE_EXTENSIONS) {
+                if ((file = folderFiles.findByName(stem + extension))) {
+                    job.fileName.replace(job.fileName.size() - 4, 4, extension);
+                    job.extensionGuessed = false;
+                    break;
+                }
+            }
+        }
+        if (!file)
+            return false;
 
-    CURLcode res = curl_easy_perform(curl);
+        string hash;
+        if (cache.findHashForUrl(job.imageUrl, hash) && !file->contentHash.empty() && hash != file->contentHash)
+            return false;
 
-    curl_easy_cleanup(curl);
-    curl_slist_free_all(headers);
+        job.actualPath = file->pathLower;
+        job.reused = true;      // bytes never seen, so nothing to cache
 
-    if (res != CURLE_OK) {
-        cerr << "Error fetching existing shared link: " << curl_easy_strerror(res) << endl;
-        return "";
+        job.out << "Already in Dropbox: " << job.fileName << " (" << job.actualPath << ")" << endl;
+        resolveLink(job);
+        return true;
     }
 
+    // Folder and the image, link and filename cells; any edit makes a new key.
+    uint64_t rowHash(size_t i) const {
+        return RunJournal::rowHash({ dropboxFolder, table.cell(i, spec.imageColumn),
+            table.cell(i, spec.linkColumn), table.cell(i, spec.fileNameColumn) });
+    }
 
-    size_t pos = readBuffer.find("\"url\":");
-    if (pos != string::npos) {
-        size_t start = readBuffer.find("\"", pos + 6) + 1;
-        size_t end = readBuffer.find("\"", start);
-        if (start != string::npos && end != string::npos) {
-            return readBuffer.substr(start, end - start);
+    // A save_url or check_job_status answer for the row; a job still in
+    // progress goes (back) into saving. After Done the row may be finished
+    // and gone, so callers must not touch job again.
+    SaveUrlState saveUrlAnswered(RowJob& job, HttpRequest& req) {
+        string metadata;
+        string reason;
+        SaveUrlState state = readSaveUrlStatus(req, job.saveJobId, metadata, reason);
+        switch (state) {
+        case SaveUrlState::Done:
+            job.saveJobId.clear();
+            uploadCompleted(job, true, metadata);
+            break;
+        case SaveUrlState::Pending:
+            // The first job in a while waits the shortest interval
+            if (saving.empty() && pollsOut == 0) {
+                pollIntervalMs = saveUrl.minPollMs;
+                pollAt = chrono::steady_clock::now() + chrono::milliseconds(pollIntervalMs);
+            }
+            saving.push_back(&job);
+            break;
+        case SaveUrlState::Failed:
+            job.saveJobId.clear();
+            job.out << "Dropbox could not fetch " << job.fileName << " (" << reason << "), downloading it here" << endl;
+            enqueueFetch(job);
+            break;
         }
+        return state;
     }
 
-    return "";
-}
-
-string extractPathLower(const string& response) {
-    size_t pos = response.find("\"path_lower\":");
-    if (pos == string::npos) return "";
-
-    size_t start = response.find("\"", pos + 13) + 1;
-    size_t end = response.find("\"", start);
-    if (start == string::npos || end == string::npos) return "";
-
-    return response.substr(start, end - start);
-}
-
-string getDropboxAccessToken() {
-    //string dropboxAccessToken = getDropboxAccessToken();
-    //cerr << "[DEBUG] Dropbox token: " << dropboxAccessToken << endl;  // <--- add this
-   //if (dropboxAccessToken.empty()) {
-        //cerr << "Failed to obtain Dropbox access token\n";
-        //return 1; }
+    // One round of check_job_status for every job outstanding when it is due.
+    // Jobs that start meanwhile wait for the next round. A round in which
+    // nothing settled, or a check failed, doubles the interval; otherwise one
+    // in which something settled halves it.
+    void pollSaves() {
+        if (saving.empty() || pollsOut > 0 || chrono::steady_clock::now() < pollAt)
+            return;
+
+        settledThisRound = 0;
+        failedThisRound = 0;
+        for (RowJob* job : vector<RowJob*>(saving)) {
+            unique_ptr<HttpRequest> req = makeCheckSaveUrlRequest(dropboxAccessToken, job->saveJobId);
+            if (!req) continue;
+            ++pollsOut;
+            req->onDone = [this, job](HttpRequest& done) {
+                // Out of saving before the answer can finish the row; still
+                // counted in pollsOut, so a job back in progress keeps the interval
+                saving.erase(find(saving.begin(), saving.end(), job));
+                if (!httpOk(done))
+                    ++failedThisRound;
+                if (saveUrlAnswered(*job, done) != SaveUrlState::Pending)
+                    ++settledThisRound;
+                if (--pollsOut == 0)
+                    nextPollRound();
+            };
+            loop.add(move(req));
+        }
+        if (pollsOut == 0)
+            nextPollRound();
+    }
 
-    CURL* curl = curl_easy_init();
-    if (!curl) return "";
+    void nextPollRound() {
+        if (settledThisRound > 0 && failedThisRound == 0) pollIntervalMs = max(saveUrl.minPollMs, pollIntervalMs / 2);
+        else pollIntervalMs = min(saveUrl.maxPollMs, pollIntervalMs * 2);
+        pollAt = chrono::steady_clock::now() + chrono::milliseconds(pollIntervalMs);
+    }
 
-    string response;
+    void awaitCommit(RowJob& job) {
+        if (toCommit.empty())
+            oldestToCommit = chrono::steady_clock::now();
+        toCommit.push_back(&job);
+    }
 
-    string postData =
-        "grant_type=refresh_token&refresh_token=" + urlEncode(DROPBOX_REFRESH_TOKEN) +
-        "&client_id=" + urlEncode(DROPBOX_APP_KEY) +
-        "&client_secret=" + urlEncode(DROPBOX_APP_SECRET);
+    // Sends the closed sessions as one finish_batch_v2 when no other batch
+    // is out and the batch is full, its oldest entry has waited lingerMs, or
+    // nothing else is in flight to join it.
+    void commitBatch() {
+        if (toCommit.empty() || capacity.commits > 0)
+            return;
+        bool full = toCommit.size() >= batch.maxEntries;
+        bool lingered = chrono::steady_clock::now() - oldestToCommit >= chrono::milliseconds(batch.lingerMs);
+        if (!full && !lingered && !loop.empty())
+            return;
+
+        size_t count = min(toCommit.size(), batch.maxEntries);
+        auto jobs = make_shared<vector<RowJob*>>(toCommit.begin(), toCommit.begin() + count);
+        toCommit.erase(toCommit.begin(), toCommit.begin() + count);
+        oldestToCommit = chrono::steady_clock::now();
+
+        vector<SessionCommit> commits;
+        for (RowJob* job : *jobs)
+            commits.push_back({ job->commitSession, job->commitBytes, dropboxFolder + job->fileName });
+
+        unique_ptr<HttpRequest> req = makeFinishBatchRequest(dropboxAccessToken, commits);
+        if (!req) {
+            HttpRequest failed;
+            failed.result = CURLE_FAILED_INIT;
+            batchCommitted(*jobs, failed);
+            return;
+        }
 
-    struct curl_slist* headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/x-www-form-urlencoded");
+        ++capacity.commits;
+        req->onDone = [this, jobs](HttpRequest& done) {
+            --capacity.commits;
+            batchCommitted(*jobs, done);
+        };
+        loop.add(move(req));
+    }
 
-    curl_easy_setopt(curl, CURLOPT_URL, "https://api.dropboxapi.com/oauth2/token");
-    curl_easy_setopt(curl, CURLOPT_POST, 1L);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postData.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeToString);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    // Maps the batch's entry results back to their rows, in order.
+    void batchCommitted(const vector<RowJob*>& jobs, HttpRequest& req) {
+        JsonElements entries(httpOk(req) ? jsonMember(req.response, "entries") : string_view());
+        for (RowJob* job : jobs) {
+            string_view entry;
+            string metadata;
+            string reason = httpError(req);
+            if (entries.next(entry) && readBatchEntry(entry, metadata, reason)) {
+                job->commitSession.clear();
+                uploadCompleted(*job, true, metadata);
+                continue;
+            }
 
-    CURLcode res = curl_easy_perform(curl);
+            // The session is still open for a commit after a write conflict
+            if (reason == "too_many_write_operations" && ++job->commitConflicts <= batch.entryRetries) {
+                awaitCommit(*job);
+                continue;
+            }
+            job->err << "Upload failed for " << job->fileName << " (" << reason << ")" << endl;
+            job->commitSession.clear();
+            finishRow(*job);
+        }
+    }
 
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    void uploadCompleted(RowJob& job, bool uploaded, const string& dropboxResponse) {
+        if (!uploaded) {
+            job.err << "Upload failed for " << job.fileName << endl;
+            finishRow(job);
+            return;
+        }
 
-    // cout << "[DEBUG] Dropbox token response: " << response << endl;
+        job.actualPath = extractPathLower(dropboxResponse);
+        if (job.actualPath.empty()) {
+            job.err << "Failed to extract Dropbox path for " << job.fileName << endl;
+            finishRow(job);
+            return;
+        }
 
-    if (res != CURLE_OK) {
-        cerr << "[ERROR] Curl failed: " << curl_easy_strerror(res) << endl;
-        return "";
+        job.out << "Uploaded " << job.fileName << endl;
+        journal.record(RunJournal::Uploaded, job.index, job.rowHash, job.actualPath);
+        resolveLink(job);
     }
 
-    // Look for "access_token" key in the JSON response
-    size_t pos = response.find("\"access_token\":");
-    if (pos == string::npos) {
-        cerr << "[ERROR] access_token not found in response" << endl;
-        return "";
+    // A freshly uploaded file almost never has a link yet, so ask for one
+    // straight away; an existing link comes back in the 409 error. Links
+    // prefetched at startup need no call at all.
+    void resolveLink(RowJob& job) {
+        auto known = folderLinks.find(job.actualPath);
+        if (known != folderLinks.end()) {
+            job.dropboxLink = known->second;
+            linkReady(job);
+            return;
+        }
+        enqueue(job, RowStage::LinkCreate);
     }
 
-    // Skip past "access_token":
-    pos += 15;
+    void linkReady(RowJob& job) {
+        job.out << "Dropbox link: " << job.dropboxLink << endl;
+        journal.record(RunJournal::Linked, job.index, job.rowHash, job.dropboxLink);
 
-    // Skip any spaces and quotes
-    while (pos < response.size() && (response[pos] == ' ' || response[pos] == '\"'))
-        ++pos;
+        if (!job.reused && !job.contentHash.empty())
+            cache.put(job.imageUrl, job.contentHash, { job.actualPath, job.dropboxLink });
+        if (!job.notModified && !job.validators.empty())
+            cache.putValidators(job.imageUrl, job.validators);
 
-    size_t end = response.find("\"", pos);
-    if (end == string::npos) {
-        cerr << "[ERROR] access_token parse failed" << endl;
-        return "";
-    }
+        // --- Update CSV data locally ---
+        size_t i = job.index;
+        string currentLink = trim(table.cell(i, spec.linkColumn));
+        table.set(i, spec.linkColumn, job.dropboxLink); // Column B
 
-    string token = response.substr(pos, end - pos);
-    //cout << "[DEBUG] Access token extracted: " << token << endl;
-    return token;
-}
+        // The row as the next run will read it; the table may have dropped
+        // it by the time the sheet write lands
+        writtenHashes[i] = rowHash(i);
 
-string getGoogleAccessToken() {
-    CURL* curl = curl_easy_init();
-    if (!curl) return "";
+        // --- Update Google Sheet ---
+        sheetWriter.queue(int(i + 1), spec.linkColumn + 1, job.dropboxLink, currentLink);
 
-    string response;
+        finishRow(job);
+    }
 
-    string postData =
-        "client_id=" + urlEncode(GOOGLE_CLIENT_ID) +
-        "&client_secret=" + urlEncode(GOOGLE_CLIENT_SECRET) +
-        "&refresh_token=" + urlEncode(GOOGLE_REFRESH_TOKEN) +
-        "&grant_type=refresh_token";
+    void finishRow(RowJob& job) {
+        releasePayload(job);
+        job.stage = RowStage::Done;
+        job.finished = true;
+        --capacity.rows;
+        flushFinishedRows();
+    }
 
-    struct curl_slist* headers = nullptr;
-    headers = curl_slist_append(headers, "Content-Type: application/x-www-form-urlencoded");
+    void flushFinishedRows() {
+        while (!rows.empty() && rows.front()->finished) {
+            RowJob& job = *rows.front();
+            writeLog(cout, job.out.str());
+            writeLog(cerr, job.err.str());
+            rows.pop_front();
+            ++nextToFlush;
+        }
+        writeRows(nextToFlush);
+    }
 
-    curl_easy_setopt(curl, CURLOPT_URL, "https://oauth2.googleapis.com/token");
-    curl_easy_setopt(curl, CURLOPT_POST, 1L);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postData.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeToString);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    // --stream-csv: rows before end go out and leave the table. Rows the
+    // feed has not delivered (a failed or empty export) are not there to go.
+    void writeRows(size_t end) {
+        end = min(end, table.rowCount());
+        if (!csvOut || nextToWrite >= end)
+            return;
+        for (; nextToWrite < end; ++nextToWrite) {
+            table.writeRow(*csvOut, nextToWrite);
+            *csvOut << "\n";
+        }
+        table.release(nextToWrite);
+    }
 
-    CURLcode res = curl_easy_perform(curl);
+    void writeLog(ostream& out, const string& text) {
+        if (logPrefix.empty()) {
+            out << text << flush;
+            return;
+        }
+        for (size_t start = 0; start < text.size();) {
+            size_t end = text.find('\n', start);
+            end = end == string::npos ? text.size() : end + 1;
+            out << logPrefix << string_view(text).substr(start, end - start);
+            start = end;
+        }
+        out << flush;
+    }
 
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    TransferLoop& loop;
+    RowCapacity& capacity;
+    SheetWriter& sheetWriter;
+    const JobSpec& spec;
+    StreamOptions streaming;
+    UploadSessionOptions sessions;
+    ImageLimits images;
+    ShardOptions shard;
+    SaveUrlOptions saveUrl;
+    BatchCommitOptions batch;
+    UploadCache& cache;
+    RunJournal& journal;
+    const unordered_map<string, string>& folderLinks;  // prefetched path_lower -> url
+    const FolderIndex& folderFiles;
+    const string& dropboxFolder;
+    string dropboxFolderLower;
+    const string& dropboxAccessToken;
+    CsvTable& table;
+
+    deque<unique_ptr<RowJob>> rows;     // from nextToFlush up to nextToAdmit
+    size_t nextToAdmit = 1;     // row 0 is the header
+    size_t nextToFlush = 1;
+    size_t nextToWrite = 0;     // --stream-csv, header included
+    unordered_map<size_t, uint64_t> writtenHashes;  // rows with a sheet write pending
+
+    // --save-url jobs Dropbox is running, and the poll rounds over them
+    vector<RowJob*> saving;
+    size_t pollsOut = 0;
+    size_t settledThisRound = 0;
+    size_t failedThisRound = 0;
+    long pollIntervalMs = 0;
+    chrono::steady_clock::time_point pollAt;
+
+    // --batch-commit sessions closed and not yet sent in a batch
+    vector<RowJob*> toCommit;
+    chrono::steady_clock::time_point oldestToCommit;
+
+    size_t unchangedRows = 0;
+    size_t otherShardRows = 0;
+
+    deque<RowJob*> queued[RowCapacity::SlotCount];
+};
+
+// Drives every job's pipeline on one loop. Admission and each slot take
+// turns round the jobs, one row or transfer at a time, so a long sheet
+// cannot hold all the capacity while the others wait.
+void runPipelines(TransferLoop& loop, RowCapacity& capacity, const vector<unique_ptr<RowPipeline>>& pipelines)
+{
+    size_t turn = 0;
+    // Steps the pipelines in turn until a full round makes no progress
+    auto roundRobin = [&](auto&& step) {
+        for (size_t idle = 0; idle < pipelines.size(); turn = (turn + 1) % pipelines.size())
+            idle = step(*pipelines[turn]) ? 0 : idle + 1;
+    };
+
+    for (;;) {
+        roundRobin([&](RowPipeline& pipeline) { return !capacity.rowsFull() && pipeline.admitNext(); });
+        for (int slot = 0; slot < RowCapacity::SlotCount; ++slot) {
+            roundRobin([&](RowPipeline& pipeline) {
+                return capacity.hasRoom(Slot(slot)) && pipeline.startNext(Slot(slot));
+            });
+        }
+        for (auto& pipeline : pipelines)
+            pipeline->tick();
+
+        if (loop.empty()) {
+            bool admitted = all_of(pipelines.begin(), pipelines.end(),
+                [](const unique_ptr<RowPipeline>& pipeline) { return pipeline->allAdmitted() && !pipeline->waiting(); });
+            if (admitted) break;
+
+            // Only save_url jobs between poll rounds: sleep until the next one
+            long waitMs = 100;
+            for (auto& pipeline : pipelines)
+                waitMs = pipeline->msUntilPoll(waitMs);
+            if (waitMs > 0)
+                this_thread::sleep_for(chrono::milliseconds(waitMs));
+            continue;
+        }
 
-    if (res != CURLE_OK) {
-        cerr << "[ERROR] Curl failed: " << curl_easy_strerror(res) << endl;
-        return "";
+        loop.runOnce();
     }
 
-    //cout << "[DEBUG] Google token response: " << response << endl;  // ← debug
+    for (auto& pipeline : pipelines)
+        pipeline->finishRows();
 
-    // Parse access_token from JSON response
-    size_t pos = response.find("\"access_token\":");
-    if (pos == string::npos) {
-        cerr << "[ERROR] access_token not found in response" << endl;
-        return "";
-    }
-    pos += 15;
-    while (pos < response.size() && (response[pos] == ' ' || response[pos] == '\"')) ++pos;
-    size_t end = response.find("\"", pos);
-    if (end == string::npos) {
-        cerr << "[ERROR] access_token parse failed" << endl;
-        return "";
+    // Write out whatever the sheet writers are still holding
+    for (;;) {
+        bool busy = false;
+        for (auto& pipeline : pipelines)
+            busy = pipeline->flushSheet() || busy;
+        if (!busy) break;
+        loop.runOnce();
     }
-
-    return response.substr(pos, end - pos);
 }
 
-bool updateSheetCell(int row, int col, const string& value, const string& accessToken) {
-    CURL* curl = curl_easy_init();
-    if (!curl) return false;
 
-    // Make sure the tab is "Images"
-    string url = "https://sheets.googleapis.com/v4/spreadsheets/" + string(GOOGLE_SHEET_ID)
-        + "/values/Images!R" + to_string(row) + "C" + to_string(col)
-        + "?valueInputOption=RAW";
+// --- Token cache ---
+// Access tokens are good for hours, so they are kept between runs in a small
+// owner-only file with their expiry and reused until a few minutes before it.
+// Entries are keyed by a hash of the credentials that minted them, so a
+// changed Configuration.h never picks up a stale token.
 
-    string jsonPayload = "{\"values\":[[\"" + value + "\"]]}";
-
-    struct curl_slist* headers = nullptr;
-    headers = curl_slist_append(headers, ("Authorization: Bearer " + accessToken).c_str());
-    headers = curl_slist_append(headers, "Content-Type: application/json");
+class TokenCache {
+public:
+    static constexpr long marginSeconds = 300;
 
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, jsonPayload.c_str());
+    void load(const string& cachePath) {
+        path = cachePath;
+        ifstream in(path);
+        string name, token;
+        long long expiresAt;
+        while (in >> name >> token >> expiresAt)
+            entries[name] = { token, expiresAt };
+    }
 
-    string response;
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeToString);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    bool find(const string& name, string& token) const {
+        auto found = entries.find(name);
+        if (found == entries.end() || found->second.expiresAt - marginSeconds <= now())
+            return false;
+        token = found->second.token;
+        return true;
+    }
 
-    CURLcode res = curl_easy_perform(curl);
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    void put(const string& name, const string& token, long expiresIn) {
+        if (expiresIn <= marginSeconds) return;
+        entries[name] = { token, now() + expiresIn };
+        dirty = true;
+    }
 
-    if (res != CURLE_OK) {
-        cerr << "[ERROR] Sheet update failed: " << curl_easy_strerror(res) << endl;
-        return false;
+    void forget(const string& name) {
+        dirty = entries.erase(name) > 0 || dirty;
     }
 
-    //cout << "[DEBUG] Sheet update response: " << response << endl;  // debug
+    void save() {
+        if (path.empty() || !dirty) return;
 
-    return true;
-}
+        // Written aside and renamed over the old file, so a crash cannot leave
+        // it truncated; a stale temp file may have wider permissions
+        string tmpPath = path + ".tmp";
+        int out = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (out < 0) return;
 
-bool dropboxLinkMatchesFilename(const string& dropboxLink, const string& fileName) {
-    if (dropboxLink.empty() || fileName.empty())
-        return false;
+        ostringstream data;
+        for (auto& entry : entries) {
+            if (entry.second.expiresAt > now())
+                data << entry.first << ' ' << entry.second.token << ' ' << entry.second.expiresAt << '\n';
+        }
+        string text = data.str();
+        bool ok = fchmod(out, 0600) == 0 &&
+            ::write(out, text.data(), text.size()) == ssize_t(text.size()) &&
+            fsync(out) == 0;
+        ::close(out);
+
+        if (ok && rename(tmpPath.c_str(), path.c_str()) == 0) {
+            dirty = false;
+            return;
+        }
+        unlink(tmpPath.c_str());
+        cerr << "Token cache not saved: " << path << endl;
+    }
 
-    return dropboxLink.find(fileName) != string::npos;
-}
+    // Cache key for a token minted from these credentials.
+    static string keyFor(const string& service, initializer_list<string_view> credentials) {
+        ostringstream key;
+        key << service << ':' << hex << fnv1a(credentials);
+        return key.str();
+    }
 
-vector<string> listTeamMemberIds(const string& accessToken) {
-    vector<string> ids;
-    CURL* curl = curl_easy_init();
-    if (!curl) return ids;
+private:
+    struct Entry {
+        string token;
+        long long expiresAt = 0;
+    };
 
-    string response;
-    curl_easy_setopt(curl, CURLOPT_URL, "https://api.dropboxapi.com/2/team/members/list");
-    curl_easy_setopt(curl, CURLOPT_POST, 1L);
+    static long long now() {
+        return chrono::duration_cast<chrono::seconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
+    }
 
-    struct curl_slist* headers = nullptr;
-    headers = curl_slist_append(headers, ("Authorization: Bearer " + accessToken).c_str());
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    string path;
+    map<string, Entry> entries;
+    bool dirty = false;
+};
+
+// --- Bootstrap ---
+// Everything the rows need before they start: both access tokens, the team
+// check, each job's CSV export and folder sweep, and one shared-link sweep
+// for all the jobs' folders. They run
+// together on the transfer loop; the Dropbox calls go out as soon as its
+// token is known, straight away when it is cached. Meanwhile a HEAD to the
+// upload and Sheets hosts resolves them and leaves a warm connection in the
+// pool. A cached token that is refused (401) is dropped and that service's
+// calls are made again with a fresh one; a cached Google token nothing here
+// would use is tried on one sheet's grid metadata. A streamed export
+// (--stream-csv) is left to the rows; it may already be arriving on the
+// same loop, and the bootstrap only waits for its own transfers.
+
+class Bootstrap {
+public:
+    // What each job gets on top of the shared tokens and links.
+    struct JobInput {
+        string csv;
+        size_t blankRows = 0;       // --read-sheet: empty rows not yet written
+        bool csvOk = false;         // always, when the export is streamed
+        FolderIndex folderFiles;
+    };
+
+    Bootstrap(TokenCache& tokens, const Options& options, const vector<JobSpec>& jobs)
+        : inputs(jobs.size()), tokens(tokens), options(options), jobs(jobs),
+          dropboxKey(TokenCache::keyFor("dropbox", { DROPBOX_APP_KEY, DROPBOX_REFRESH_TOKEN })),
+          googleKey(TokenCache::keyFor("google", { GOOGLE_CLIENT_ID, GOOGLE_REFRESH_TOKEN })) {}
+
+    // False once a failure has been reported; the run cannot go on.
+    bool run(TransferLoop& transfers) {
+        loop = &transfers;
+
+        startDropbox();
+        startGoogle();
+        for (size_t j = 0; j < jobs.size(); ++j) {
+            if (options.csvStream.enabled()) inputs[j].csvOk = true;
+            else if (!options.sheetRead.enabled) startCsv(j);
+        }
+        warm(serviceUrls().dropboxContent + "/");
+        warm(serviceUrls().sheets + "/");
 
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, "{}"); // empty body
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeToString);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+        while (pending > 0)
+            transfers.runOnce();
 
-    CURLcode res = curl_easy_perform(curl);
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+        loop = nullptr;
+        tokens.save();
 
-    if (res != CURLE_OK) {
-        cerr << "Failed to list team members: " << curl_easy_strerror(res) << endl;
-        return ids;
+        // Reported in the order the serial startup checked them
+        if (dropboxAccessToken.empty()) {
+            cerr << "Failed to obtain Dropbox access token\n";
+            return false;
+        }
+        if (teamMembers.empty()) {
+            cerr << "No team members found!\n";
+            return false;
+        }
+        // Sheet reads need the Google token, so its failure explains theirs
+        if (options.sheetRead.enabled && googleAccessToken.empty()) {
+            cerr << "Failed to get Google access token\n";
+            return false;
+        }
+        // A job without its CSV is dropped; the others still run
+        size_t csvCount = 0;
+        for (size_t j = 0; j < jobs.size(); ++j) {
+            if (inputs[j].csvOk) {
+                ++csvCount;
+                continue;
+            }
+            cerr << (options.sheetRead.enabled ? "Failed to read sheet" : "Failed to download CSV");
+            if (jobs.size() > 1) cerr << " for " << jobs[j].label();
+            cerr << "\n";
+        }
+        if (csvCount == 0)
+            return false;
+        if (googleAccessToken.empty()) {
+            cerr << "Failed to get Google access token\n";
+            return false;
+        }
+        return true;
     }
 
-    // Parse team_member_id dynamically
-    size_t pos = 0;
-    while ((pos = response.find("\"team_member_id\":", pos)) != string::npos) {
-        size_t start = response.find("\"", pos + 17) + 1;
-        size_t end = response.find("\"", start);
-        if (start != string::npos && end != string::npos) {
-            ids.push_back(response.substr(start, end - start));
-            pos = end;
+    string dropboxAccessToken;
+    string googleAccessToken;
+    vector<string> teamMembers;
+    vector<JobInput> inputs;                    // one per job, in order
+    unordered_map<string, string> folderLinks;  // every job's folder
+
+private:
+    void startDropbox() {
+        if (options.tokens.enabled && tokens.find(dropboxKey, dropboxAccessToken)) {
+            dropboxCached = true;
+            startDropboxCalls();
+            return;
         }
-        else break;
-    }
 
-    return ids;
-}
+        add(makeDropboxTokenRequest(), [this](HttpRequest& done) {
+            long expiresIn = 0;
+            if (!finishAccessTokenRequest(done, dropboxAccessToken, expiresIn))
+                return;
+            tokens.put(dropboxKey, dropboxAccessToken, expiresIn);
+            startDropboxCalls();
+        });
+    }
 
+    void startGoogle() {
+        if (options.tokens.enabled && tokens.find(googleKey, googleAccessToken)) {
+            googleCached = true;
+            startGoogleCalls();
+            return;
+        }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cerr << "Dropbox folder required\n";
-        return 1;
+        add(makeGoogleTokenRequest(), [this](HttpRequest& done) {
+            long expiresIn = 0;
+            if (!finishAccessTokenRequest(done, googleAccessToken, expiresIn))
+                return;
+            tokens.put(googleKey, googleAccessToken, expiresIn);
+            startGoogleCalls();
+        });
     }
 
-    std::string DROPBOX_FOLDER = argv[1];
-    if (DROPBOX_FOLDER.back() != '/')
-        DROPBOX_FOLDER += '/';
+    // --read-sheet without --stream-csv: every job's rows before any starts.
+    // Otherwise a cached token is tried on one job's grid metadata, so a
+    // revoked one is replaced now rather than failing every sheet write.
+    void startGoogleCalls() {
+        int generation = ++googleGeneration;
+        if (!options.sheetRead.enabled || options.csvStream.enabled()) {
+            if (googleCached) {
+                add(makeSheetGridRequest(jobs[0].sheetId, googleAccessToken), [this, generation](HttpRequest& done) {
+                    if (generation == googleGeneration) googleRefused(done);
+                });
+            }
+            return;
+        }
 
-    curl_global_init(CURL_GLOBAL_DEFAULT);
+        for (size_t j = 0; j < jobs.size(); ++j) {
+            inputs[j].csv.clear();
+            inputs[j].blankRows = 0;
+            add(makeSheetGridRequest(jobs[j].sheetId, googleAccessToken), [this, generation, j](HttpRequest& done) {
+                if (generation != googleGeneration || googleRefused(done)) return;
+                size_t rowCount = 0;
+                if (readSheetRowCount(done, jobs[j].tab, rowCount) && rowCount > 0)
+                    readSheet(generation, j, 0, rowCount);
+            });
+        }
+    }
 
-    // --- Dropbox access token ---
-    string dropboxAccessToken = getDropboxAccessToken();
-    if (dropboxAccessToken.empty()) {
-        cerr << "Failed to obtain Dropbox access token\n";
-        return 1;
+    // Blocks go one after another; the read quota allows no more anyway.
+    void readSheet(int generation, size_t j, size_t firstRow, size_t rowCount) {
+        size_t rows = min(options.sheetRead.blockRows, rowCount - firstRow);
+        bool last = firstRow + rows >= rowCount;
+        add(makeSheetValuesRequest(jobs[j].sheetId, jobs[j].tab, jobs[j].columns(), firstRow, rows, googleAccessToken),
+            [this, generation, j, firstRow, rows, last, rowCount](HttpRequest& done) {
+                if (generation != googleGeneration || googleRefused(done)) return;
+                JobInput& input = inputs[j];
+                if (!readSheetValues(done, jobs[j].columns(), rows, input.csv, input.blankRows)) {
+                    input.csv.clear();
+                    return;
+                }
+                if (!last) readSheet(generation, j, firstRow + rows, rowCount);
+                else input.csvOk = !input.csv.empty();
+            });
     }
-    vector<string> teamMembers = listTeamMemberIds(dropboxAccessToken);
-    if (teamMembers.empty()) {
-        cerr << "No team members found!\n";
-        return 1;
+
+    void startCsv(size_t j) {
+        add(makeDownloadCSVRequest(jobs[j].csvUrl), [this, j](HttpRequest& done) {
+            JobInput& input = inputs[j];
+            input.csvOk = finishDownloadCSV(done, input.csv) && !input.csv.empty();
+        });
     }
 
-    // --- Download CSV ---
-    string csvRaw = downloadCSV();
-    if (csvRaw.empty()) {
-        cerr << "Failed to download CSV\n";
-        return 1;
+    // A bodiless request just for the DNS lookup and the connection.
+    void warm(const string& url) {
+        auto req = make_unique<HttpRequest>(url, "warmup");
+        if (!req->curl) return;
+        curl_easy_setopt(req->curl, CURLOPT_NOBODY, 1L);
+        ++pending;
+        req->onDone = [this](HttpRequest&) { --pending; };
+        loop->add(move(req));
     }
 
-    // --- Extract columns ---
-    vector<string> imageUrls = extractColumn(csvRaw, IMAGE_COLUMN_INDEX);
-    vector<string> fileNames = extractColumn(csvRaw, FILENAME_COLUMN_INDEX);
+    // Team check and folder sweeps, tagged with the token generation so
+    // answers to a refused token are ignored once it has been replaced.
+    void startDropboxCalls() {
+        int generation = ++dropboxGeneration;
+        teamMembers.clear();
+        folderLinks.clear();
+        for (JobInput& input : inputs)
+            input.folderFiles = FolderIndex();
+
+        add(makeTeamMembersRequest(dropboxAccessToken), [this, generation](HttpRequest& done) {
+            if (generation != dropboxGeneration || dropboxRefused(done)) return;
+            teamMembers = finishListTeamMemberIds(done);
+        });
+
+        if (options.prefetchLinks)
+            listSharedLinks(generation, "");
+        if (options.indexFolder) {
+            for (size_t j = 0; j < jobs.size(); ++j)
+                listFolder(generation, j, "");
+        }
+    }
 
-    // --- Parse CSV into 2D vector ---
-    vector<vector<string>> csvData;
-    string line;
-    stringstream ss(csvRaw);
-    while (getline(ss, line)) {
-        stringstream lineStream(line);
-        string cell;
-        vector<string> row;
-        while (getline(lineStream, cell, ',')) row.push_back(cell);
-        csvData.push_back(row);
+    void listSharedLinks(int generation, const string& cursor) {
+        add(makeListSharedLinksRequest(dropboxAccessToken, cursor), [this, generation](HttpRequest& done) {
+            if (generation != dropboxGeneration || dropboxRefused(done)) return;
+            vector<string> folders;
+            for (const JobSpec& job : jobs)
+                folders.push_back(lowercase(job.dropboxFolder));
+            string next;
+            if (readSharedLinksPage(done, folders, folderLinks, next))
+                listSharedLinks(generation, next);
+        });
     }
 
-    // --- Google access token ---
-    string googleAccessToken = getGoogleAccessToken();
-    if (googleAccessToken.empty()) {
-        cerr << "Failed to get Google access token\n";
-        return 1;
+    void listFolder(int generation, size_t j, const string& cursor) {
+        add(makeListFolderRequest(dropboxAccessToken, jobs[j].dropboxFolder, cursor), [this, generation, j](HttpRequest& done) {
+            if (generation != dropboxGeneration || dropboxRefused(done)) return;
+            string next;
+            if (readFolderPage(done, inputs[j].folderFiles, next))
+                listFolder(generation, j, next);
+        });
     }
 
-    // --- Process each row ---
-    for (size_t i = 1; i < imageUrls.size(); ++i) {
-        string cell = trim(imageUrls[i]);
-        string existingLink =
-            (i < csvData.size() && csvData[i].size() > 1)
-            ? trim(csvData[i][1])
-            : "";
+    // A 401 on a cached token: forget it and start over with a new one.
+    bool dropboxRefused(HttpRequest& done) {
+        if (!dropboxCached || done.status != 401)
+            return false;
+
+        dropboxCached = false;
+        dropboxAccessToken.clear();
+        ++dropboxGeneration;
+        tokens.forget(dropboxKey);
+        startDropbox();
+        return true;
+    }
 
-        // Expected filename (Column C)
-        string expectedFileName =
-            (i < fileNames.size() && !fileNames[i].empty())
-            ? fileNames[i]
-            : "image_" + to_string(i + 1) + ".jpg";
+    bool googleRefused(HttpRequest& done) {
+        if (!googleCached || done.status != 401)
+            return false;
 
-        if (expectedFileName.find('.') == string::npos)
-            expectedFileName += ".jpg";
+        googleCached = false;
+        googleAccessToken.clear();
+        ++googleGeneration;
+        tokens.forget(googleKey);
+        startGoogle();
+        return true;
+    }
 
-        // Skip ONLY if Dropbox link already matches filename
-        if (!existingLink.empty() &&
-            existingLink.find("dropbox.com") != string::npos &&
-            dropboxLinkMatchesFilename(existingLink, expectedFileName))
-        {
-            cout << "Skipping row " << i + 2 << " (Dropbox link matches filename)" << endl;
-            continue;
+    void add(unique_ptr<HttpRequest> req, function<void(HttpRequest&)> onDone) {
+        if (!req) {
+            HttpRequest failed;
+            failed.result = CURLE_FAILED_INIT;
+            onDone(failed);
+            return;
         }
+        ++pending;
+        req->onDone = [this, onDone = move(onDone)](HttpRequest& done) {
+            --pending;
+            onDone(done);
+        };
+        loop->add(move(req));
+    }
 
-        // Validate image URL (replaces needsProcessing)
-        if (cell.empty() || cell.rfind("http", 0) != 0) {
-            //cout << "Skipping row " << i + 2 << " (invalid image URL)" << endl;
-            continue;
-        }
+    TransferLoop* loop = nullptr;   // only while run() is going
+    size_t pending = 0;             // bootstrap transfers not yet done
+    TokenCache& tokens;
+    const Options& options;
+    const vector<JobSpec>& jobs;
+    string dropboxKey;
+    string googleKey;
 
-        // --- Download image ---
-        string imageData;
-        if (!downloadImage(cell, imageData)) {
-            cerr << "Failed to download image from " << cell << endl;
-            continue;
-        }
+    bool dropboxCached = false;
+    int dropboxGeneration = 0;
+    bool googleCached = false;
+    int googleGeneration = 0;
+};
 
-        // --- Determine file name ---
-        string fileName = (i < fileNames.size() && !fileNames[i].empty())
-            ? fileNames[i]
-            : "image_" + to_string(i + 1) + ".jpg";
-        if (fileName.find('.') == string::npos) fileName += ".jpg";
 
-        string dropboxPath = DROPBOX_FOLDER + fileName;
-        string dropboxResponse;
+int main(int argc, char* argv[]) {
+    std::string DROPBOX_FOLDER;
+    Options options;
+    vector<string> reportFiles;     // with --merge-reports
+
+    for (int a = 1; a < argc; ++a) {
+        string arg = argv[a];
+        if (arg.rfind("--", 0) == 0) {
+            if (!parseOption(arg, options)) {
+                cerr << "Invalid option: " << arg << "\n";
+                return 1;
+            }
+        }
+        else {
+            reportFiles.push_back(arg);
+            if (DROPBOX_FOLDER.empty())
+                DROPBOX_FOLDER = arg;
+        }
+    }
 
-        //cerr << "[DEBUG] Using team member ID: " << DROPBOX_TEAM_MEMBER_ID << endl;
-       // cerr << "[DEBUG] Using namespace ID: " << DROPBOX_NAMESPACE_ID << endl;
+    // --- Merge shard reports ---
+    if (options.mergeReports)
+        return mergeReports(reportFiles, options.report);
 
-        // --- Upload to Dropbox ---
-        if (!uploadToDropbox(dropboxAccessToken, imageData, dropboxPath, dropboxResponse)) {
-            cerr << "Upload failed for " << fileName << endl;
-            continue;
+    // --- Jobs ---
+    vector<JobSpec> jobs;
+    if (!options.jobsPath.empty()) {
+        if (!DROPBOX_FOLDER.empty()) {
+            std::cerr << "Give either a Dropbox folder or --jobs, not both\n";
+            return 1;
         }
+        string error;
+        if (!readJobManifest(options.jobsPath, jobs, error)) {
+            std::cerr << "Invalid job manifest: " << error << "\n";
+            return 1;
+        }
+    }
+    else {
+        if (DROPBOX_FOLDER.empty()) {
+            std::cerr << "Dropbox folder required\n";
+            return 1;
+        }
+        jobs.push_back(defaultJob(DROPBOX_FOLDER));
+    }
 
-        string actualPath = extractPathLower(dropboxResponse);
-        if (actualPath.empty()) {
-            cerr << "Failed to extract Dropbox path for " << fileName << endl;
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    if (options.transport.http2) {
+        const ServiceUrls& urls = serviceUrls();
+        connectionPool().multiplex({ urls.dropboxApi, urls.dropboxContent, urls.sheets });
+    }
+    auto runStarted = chrono::steady_clock::now();
+
+    // One loop for the bootstrap and the rows, so a streamed export can
+    // start downloading straight away. Reset before the pool and libcurl go.
+    auto loop = make_unique<TransferLoop>(options.rates, options.transport);
+
+    // --- Per job: CSV index (owns the export), run journal, streamed output ---
+    struct JobRun {
+        const JobSpec* spec = nullptr;
+        CsvTable table;
+        RunJournal journal;
+        unique_ptr<CsvFeed> feed;   // --stream-csv
+        string csvPath;
+        ofstream csvOut;
+    };
+
+    // Each job and shard keeps its own journal and streamed CSV, since rows
+    // are keyed by index
+    auto jobSuffix = [&](size_t j) {
+        ostringstream suffix;
+        if (jobs.size() > 1)
+            suffix << '.' << hex << fnv1a({ jobs[j].sheetId, jobs[j].tab, jobs[j].dropboxFolder }) << dec;
+        if (options.shard.enabled())
+            suffix << ".shard-" << options.shard.index + 1 << "-of-" << options.shard.count;
+        return suffix.str();
+    };
+
+    vector<unique_ptr<JobRun>> runs;
+    for (size_t j = 0; j < jobs.size(); ++j) {
+        runs.push_back(make_unique<JobRun>());
+        JobRun& run = *runs.back();
+        run.spec = &jobs[j];
+        if (!options.csvStream.enabled())
             continue;
+
+        run.csvPath = options.csvStream.outPath + jobSuffix(j);
+        run.csvOut.open(run.csvPath, ios::binary | ios::trunc);
+        if (!run.csvOut) {
+            cerr << "Cannot write updated CSV: " << run.csvPath << endl;
+            return 1;
         }
+        run.feed = make_unique<CsvFeed>(run.table, options.csvStream.window);
+        // Sheet values need the Google token, so they wait for the bootstrap
+        if (!options.sheetRead.enabled)
+            run.feed->start(*loop, jobs[j].csvUrl);
+    }
 
-        cout << "Uploaded " << fileName << endl;
+    // --- Tokens, team check, CSV and folder sweeps ---
+    TokenCache tokens;
+    if (options.tokens.enabled)
+        tokens.load(options.tokens.path);
 
-        // --- Get or create shared link ---
-        string dropboxLink = getExistingSharedLink(dropboxAccessToken, actualPath);
-        if (dropboxLink.empty() && !createDropboxShareLink(dropboxAccessToken, actualPath, dropboxLink)) {
-            cerr << "Failed to create shared link for " << fileName << endl;
-            continue;
-        }
+    Bootstrap bootstrap(tokens, options, jobs);
+    if (!bootstrap.run(*loop)) {
+        writeTransferReports(options.report, runStarted);
+        return 1;
+    }
 
-        cout << "Dropbox link: " << dropboxLink << endl;
+    const string& dropboxAccessToken = bootstrap.dropboxAccessToken;
+    const string& googleAccessToken = bootstrap.googleAccessToken;
 
-        // --- Update CSV data locally ---
-        if (i < csvData.size()) {
-            csvData[i].resize(max<size_t>(3, csvData[i].size()));
-            csvData[i][1] = dropboxLink; // Column B
+    // --- Upload cache ---
+    UploadCache uploadCache;
+    if (options.cache.enabled && !uploadCache.open(options.cache.path))
+        cerr << "Upload cache unavailable: " << options.cache.path << endl;
+
+    // Jobs whose CSV failed were reported by the bootstrap and are left out.
+    size_t failedJobs = 0;
+    for (size_t j = 0; j < jobs.size(); ++j) {
+        if (!bootstrap.inputs[j].csvOk) {
+            runs[j].reset();
+            ++failedJobs;
+            continue;
         }
+        if (!options.csvStream.enabled())
+            runs[j]->table = CsvTable(move(bootstrap.inputs[j].csv));
+        else if (options.sheetRead.enabled)
+            runs[j]->feed->startSheet(*loop, jobs[j].sheetId, jobs[j].tab, jobs[j].columns(),
+                options.sheetRead.blockRows, googleAccessToken);
+
+        JournalOptions journalOptions = options.journal;
+        journalOptions.path += jobSuffix(j);
+        if (journalOptions.enabled && !runs[j]->journal.open(journalOptions))
+            cerr << "Run journal unavailable: " << journalOptions.path << endl;
+    }
 
-        // --- Update Google Sheet ---
-        if (!updateSheetCell(i + 1, 2, dropboxLink, googleAccessToken)) {
-            cerr << "Failed to update Google Sheet for row " << i + 1 << endl;
+    // --- Process rows ---
+    {
+        RowCapacity capacity(options.limits, options.memory);
+        vector<unique_ptr<SheetWriter>> sheetWriters;
+        vector<unique_ptr<RowPipeline>> pipelines;
+        for (size_t j = 0; j < jobs.size(); ++j) {
+            if (!runs[j]) continue;
+            JobRun& run = *runs[j];
+            sheetWriters.push_back(make_unique<SheetWriter>(*loop, options.sheetWrites, options.limits.sheet,
+                googleAccessToken, run.spec->sheetId, run.spec->tab));
+            pipelines.push_back(make_unique<RowPipeline>(*loop, capacity, *sheetWriters.back(), *run.spec,
+                options.streaming, options.sessions, options.images, options.shard, options.saveUrl, options.batchCommit, uploadCache, run.journal,
+                bootstrap.folderLinks, bootstrap.inputs[j].folderFiles, dropboxAccessToken, run.table));
+            if (jobs.size() > 1)
+                pipelines.back()->logPrefix = "[" + run.spec->label() + "] ";
+            if (run.feed) {
+                pipelines.back()->feed = run.feed.get();
+                pipelines.back()->csvOut = &run.csvOut;
+            }
         }
+        runPipelines(*loop, capacity, pipelines);
     }
+    loop.reset();
+
+    for (size_t j = 0; j < jobs.size(); ++j) {
+        if (!runs[j]) continue;
+        JobRun& run = *runs[j];
+        run.journal.sync();
+        run.journal.compact();
+
+        // A streamed export that broke off leaves its output short
+        if (run.feed) {
+            if (!run.feed->succeeded()) {
+                cerr << (options.sheetRead.enabled ? "Failed to read sheet" : "Failed to download CSV");
+                if (jobs.size() > 1) cerr << " for " << run.spec->label();
+                cerr << "\n";
+                ++failedJobs;
+                continue;
+            }
+            if (jobs.size() > 1)
+                cout << "\nUpdated CSV for " << run.spec->label() << " written to " << run.csvPath << "\n";
+            else
+                cout << "\nUpdated CSV written to " << run.csvPath << "\n";
+            continue;
+        }
 
-    // --- Print updated CSV ---
-    cout << "\nUpdated CSV:\n";
-    for (auto& row : csvData) {
-        for (size_t j = 0; j < row.size(); ++j) {
-            cout << row[j];
-            if (j + 1 < row.size()) cout << ",";
+        // --- Print updated CSV ---
+        if (jobs.size() > 1)
+            cout << "\nUpdated CSV for " << run.spec->label() << ":\n";
+        else
+            cout << "\nUpdated CSV:\n";
+        for (size_t row = 0; row < run.table.rowCount(); ++row) {
+            run.table.writeRow(cout, row);
+            cout << "\n";
         }
-        cout << "\n";
     }
 
+    writeTransferReports(options.report, runStarted);
+
+    connectionPool().shutdown();
     curl_global_cleanup();
-    return 0;
+    return failedJobs == 0 ? 0 : 1;
 }